@@ -1,76 +1,1135 @@
+// fseeko, ftello and lstat, and the header's file API and timing, are POSIX, which strict C builds (like -std=c99) only declare when asked;
+// 64-bit offsets let archives and their files be bigger than 2 GiB on 32-bit systems
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <io.h>
+#include <fcntl.h>
+#include <direct.h>
+#define file_seek _fseeki64
+#define file_tell _ftelli64
+#define make_dir(path) _mkdir(path)
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#define file_seek fseeko
+#define file_tell ftello
+#define make_dir(path) mkdir(path, 0777)
+#endif
 
 #include "barph_impl.h"
 
+static void write_to_file(void * userdata, const uint8_t * data, size_t len)
+{
+    fwrite(data, 1, len, (FILE *)userdata);
+}
+
+// reads the rest of a file that might be a pipe, so its length can't be known ahead of time; exits if it runs out of memory
+static byte_buffer_t read_all(FILE * f, byte_buffer_t buf)
+{
+    while (1)
+    {
+        if (bytes_reserve(&buf, 1 << 16) != 0)
+        {
+            fprintf(stderr, "error: out of memory\n");
+            exit(-1);
+        }
+        size_t n = fread(&buf.data[buf.len], 1, buf.cap - buf.len, f);
+        if (n == 0)
+            return buf;
+        buf.len += n;
+    }
+}
+
+// parses -r's offset,length; returns nonzero unless it's exactly two decimal numbers with a comma between them
+static int parse_range(const char * arg, uint64_t * offset, size_t * len)
+{
+    char * end;
+    // strtoull would take leading spaces and signs too, so each number has to start with a digit
+    if (arg[0] < '0' || arg[0] > '9')
+        return -1;
+    errno = 0;
+    unsigned long long o = strtoull(arg, &end, 10);
+    if (*end != ',' || end[1] < '0' || end[1] > '9' || errno)
+        return -1;
+    unsigned long long n = strtoull(end + 1, &end, 10);
+    if (*end != 0 || errno || n > SIZE_MAX)
+        return -1;
+    *offset = o;
+    *len = (size_t)n;
+    return 0;
+}
+
+// loads a dictionary file, or exits if it can't
+static void load_dict(barph_dict_t * dict, const char * path)
+{
+    byte_buffer_t buf = {0, 0, 0, 0};
+    FILE * f = fopen(path, "rb");
+    if (f)
+    {
+        buf = read_all(f, buf);
+        fclose(f);
+    }
+    if (!f || barph_dict_load(dict, buf.data, buf.len) != 0)
+    {
+        fprintf(stderr, "error: failed to load dictionary");
+        exit(-1);
+    }
+    free(buf.data);
+}
+
+// picks the compression flags for data, for -a
+static void choose_flags(const uint8_t * data, size_t len, uint8_t * do_rle, uint8_t * do_huff, uint8_t * do_diff)
+{
+    barph_ctx_t ctx;
+    barph_ctx_init(&ctx);
+    barph_choose_flags(&ctx, data, len, do_rle, do_huff, do_diff);
+    barph_ctx_free(&ctx);
+}
+
+// for --stats; goes to stderr, since the output can be stdout
+static void print_stats(const barph_stats_t * stats)
+{
+    static const char * const names[BARPH_STAGE_COUNT] = {"delta", "rle", "huffman", "hash"};
+    fprintf(stderr, "total: %.3f ms\n", stats->seconds * 1e3);
+    for (size_t k = 0; k < BARPH_STAGE_COUNT; k++)
+    {
+        const barph_stage_stats_t * stage = &stats->stages[k];
+        if (stage->in_bytes == 0 && stage->seconds == 0)
+            continue;
+        fprintf(stderr, "%s: %.3f ms, %llu", names[k], stage->seconds * 1e3, (unsigned long long)stage->in_bytes);
+        // the hash has no output
+        if (k != BARPH_STAGE_HASH)
+            fprintf(stderr, " -> %llu", (unsigned long long)stage->out_bytes);
+        fprintf(stderr, " bytes, %.1f MB/s\n", stage->seconds > 0 ? stage->in_bytes / stage->seconds / 1e6 : 0.0);
+    }
+    for (size_t h = 0; h < 2; h++)
+    {
+        const uint64_t * buckets = h ? stats->rle_literals : stats->rle_runs;
+        int any = 0;
+        for (size_t k = 0; k < BARPH_STATS_BUCKETS; k++)
+        {
+            if (!buckets[k])
+                continue;
+            if (!any)
+                fprintf(stderr, "rle %s by length:", h ? "literals" : "runs");
+            fprintf(stderr, " %llu-%llu: %llu", 1ULL << k, (2ULL << k) - 1, (unsigned long long)buckets[k]);
+            any = 1;
+        }
+        if (any)
+            fprintf(stderr, "\n");
+    }
+    if (stats->huff_symbols)
+        fprintf(stderr, "huffman: longest code %d bits, %.3f bits per byte\n", stats->huff_max_bits, (double)stats->huff_bits / stats->huff_symbols);
+    if (stats->peak_bytes)
+        fprintf(stderr, "memory: %llu allocations, %llu peak bytes\n", (unsigned long long)stats->allocs, (unsigned long long)stats->peak_bytes);
+}
+
+// archives (a, u and l modes) hold many files, each compressed on its own, so that they can be packed and unpacked several at once
+// layout: "bRPA", then each file as barph_compress_into writes it, then the directory, then a trailer: the directory's offset (8 bytes),
+// the number of files (4 bytes) and the directory's checksum (4 bytes)
+// each directory entry is the file's offset, compressed length and raw length (8 bytes each), then the length of its name (2 bytes) and the name,
+// with / between directories. a file can be found from the directory alone, and its bytes are a barph file of their own
+#define ARCHIVE_TRAILER_SIZE 16
+#define ARCHIVE_ENTRY_SIZE 26
+#define ARCHIVE_MAX_NAME 4095
+// how much input is read in and compressed at once while packing, so that memory use doesn't grow with the archive
+#define ARCHIVE_BATCH_BYTES (256 << 20)
+
+typedef struct {
+    char * name;
+    // where the file is read from, or written to
+    char * path;
+    uint64_t offset;
+    uint64_t packed_len;
+    uint64_t raw_len;
+    uint8_t * packed;
+    int failed;
+} archive_entry_t;
+
+typedef struct {
+    archive_entry_t * entries;
+    size_t count;
+    size_t cap;
+    // entries[first] is the pool's index 0
+    size_t first;
+    uint8_t flags[3];
+    int use_auto;
+    const barph_dict_t * dict;
+    size_t lz_window;
+    size_t planes;
+    const char * archive_path;
+} archive_t;
+
+// returns null if it runs out of memory
+static char * copy_string(const char * s, size_t len)
+{
+    char * copy = (char *)malloc(len + 1);
+    if (!copy)
+        return 0;
+    memcpy(copy, s, len);
+    copy[len] = 0;
+    return copy;
+}
+
+// names come from the archive, so they're checked before being used as paths: they can't be absolute, or have empty, . or .. parts,
+// and \ and : are left out so that they mean the same thing everywhere
+static int archive_name_ok(const char * name)
+{
+    if (strlen(name) > ARCHIVE_MAX_NAME || strchr(name, '\\') || strchr(name, ':'))
+        return 0;
+    const char * part = name;
+    while (1)
+    {
+        const char * end = strchr(part, '/');
+        size_t n = end ? (size_t)(end - part) : strlen(part);
+        if (n == 0 || (n == 1 && part[0] == '.') || (n == 2 && part[0] == '.' && part[1] == '.'))
+            return 0;
+        if (!end)
+            return 1;
+        part = end + 1;
+    }
+}
+
+static int archive_name_compare(const void * a, const void * b)
+{
+    return strcmp(((const archive_entry_t *)a)->name, ((const archive_entry_t *)b)->name);
+}
+
+// compares name with the first n characters of prefix, like strcmp would with them cut off there
+static int archive_prefix_compare(const char * name, const char * prefix, size_t n)
+{
+    int order = strncmp(name, prefix, n);
+    return order ? order : name[n] != 0;
+}
+
+// the names have to be in order, each only once, and none can be a directory that another is in, so that no two files are unpacked into the same place;
+// returns the first name that breaks that, or null if none do
+static const char * archive_name_clash(const archive_t * a)
+{
+    for (size_t i = 0; i < a->count; i++)
+    {
+        const char * name = a->entries[i].name;
+        if (i > 0 && strcmp(a->entries[i - 1].name, name) >= 0)
+            return name;
+        // each directory the name is in sorts before it, so it's looked for among the names before it
+        for (const char * c = strchr(name, '/'); c; c = strchr(c + 1, '/'))
+        {
+            size_t lo = 0;
+            size_t hi = i;
+            while (lo < hi)
+            {
+                size_t mid = lo + (hi - lo) / 2;
+                int order = archive_prefix_compare(a->entries[mid].name, name, c - name);
+                if (order == 0)
+                    return name;
+                if (order < 0)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+        }
+    }
+    return 0;
+}
+
+// adds the file at path to the archive under name; returns nonzero if it can't be
+static int archive_add(archive_t * a, const char * path, const char * name)
+{
+    while (name[0] == '/' || (name[0] == '.' && name[1] == '/'))
+        name += name[0] == '/' ? 1 : 2;
+    char * stored = copy_string(name, strlen(name));
+    if (!stored)
+    {
+        fprintf(stderr, "error: out of memory\n");
+        return -1;
+    }
+#if defined(_WIN32)
+    for (char * c = stored; *c; c++)
+    {
+        if (*c == '\\')
+            *c = '/';
+    }
+#endif
+    int name_ok = archive_name_ok(stored);
+    FILE * f = name_ok ? fopen(path, "rb") : 0;
+    if (!f)
+    {
+        fprintf(stderr, name_ok ? "error: failed to open %s\n" : "error: %s can't be stored; its name can't have . or .. parts, \\ or :\n", path);
+        free(stored);
+        return -1;
+    }
+    file_seek(f, 0, SEEK_END);
+    uint64_t len = file_tell(f);
+    fclose(f);
+    
+    char * copied_path = copy_string(path, strlen(path));
+    if (copied_path && a->count == a->cap)
+    {
+        size_t cap = a->cap ? a->cap * 2 : 64;
+        archive_entry_t * entries = (archive_entry_t *)realloc(a->entries, sizeof(archive_entry_t) * cap);
+        if (entries)
+        {
+            a->entries = entries;
+            a->cap = cap;
+        }
+    }
+    if (!copied_path || a->count == a->cap)
+    {
+        fprintf(stderr, "error: out of memory\n");
+        free(copied_path);
+        free(stored);
+        return -1;
+    }
+    archive_entry_t * e = &a->entries[a->count++];
+    memset(e, 0, sizeof(archive_entry_t));
+    e->name = stored;
+    e->path = copied_path;
+    e->raw_len = len;
+    return 0;
+}
+
+// adds every file in the directory at path and its subdirectories, named by their paths past the first root_len characters
+static int archive_walk(archive_t * a, const char * path, size_t root_len)
+{
+    char full[4096];
+    int failed = 0;
+#if defined(_WIN32)
+    snprintf(full, sizeof(full), "%s\\*", path);
+    WIN32_FIND_DATAA found;
+    HANDLE find = FindFirstFileA(full, &found);
+    if (find == INVALID_HANDLE_VALUE)
+        return 0;
+    do
+    {
+        if (strcmp(found.cFileName, ".") == 0 || strcmp(found.cFileName, "..") == 0)
+            continue;
+        snprintf(full, sizeof(full), "%s\\%s", path, found.cFileName);
+        if (found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            failed |= archive_walk(a, full, root_len);
+        else
+            failed |= archive_add(a, full, full + root_len);
+    } while (!failed && FindNextFileA(find, &found));
+    FindClose(find);
+#else
+    DIR * dir = opendir(path);
+    if (!dir)
+    {
+        fprintf(stderr, "error: failed to open %s\n", path);
+        return -1;
+    }
+    struct dirent * entry;
+    struct stat info;
+    while (!failed && (entry = readdir(dir)))
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        snprintf(full, sizeof(full), "%s/%s", path, entry->d_name);
+        // links to directories aren't followed, so they can't loop
+        if (lstat(full, &info) != 0)
+            continue;
+        if (S_ISDIR(info.st_mode))
+            failed |= archive_walk(a, full, root_len);
+        else if (stat(full, &info) == 0 && S_ISREG(info.st_mode))
+            failed |= archive_add(a, full, full + root_len);
+    }
+    closedir(dir);
+#endif
+    return failed;
+}
+
+static void archive_free(archive_t * a)
+{
+    for (size_t i = 0; i < a->count; i++)
+    {
+        free(a->entries[i].name);
+        free(a->entries[i].path);
+        free(a->entries[i].packed);
+    }
+    free(a->entries);
+}
+
+static void archive_pack_task(void * userdata, size_t index)
+{
+    archive_t * a = (archive_t *)userdata;
+    archive_entry_t * e = &a->entries[a->first + index];
+    e->failed = 1;
+    barph_file_t in;
+    if (barph_file_read(&in, e->path, a->flags[2] && !a->use_auto) != 0)
+        return;
+    // a file that changed size since it was listed fails, rather than being stored with the wrong length
+    if (in.len != e->raw_len)
+    {
+        barph_file_close(&in);
+        return;
+    }
+    uint8_t * data = in.data;
+    size_t len = in.len;
+    
+    uint8_t do_rle = a->flags[0];
+    uint8_t do_huff = a->flags[1];
+    uint8_t do_diff = a->flags[2];
+    barph_ctx_t ctx;
+    barph_ctx_init(&ctx);
+    if (a->use_auto)
+        barph_choose_flags(&ctx, data, len, &do_rle, &do_huff, &do_diff);
+    if (a->dict && do_huff)
+        do_huff = BARPH_HUFF_DICT;
+    ctx.dict = a->dict;
+    if (a->lz_window)
+        ctx.lz_window = a->lz_window;
+    ctx.planes = a->planes;
+    
+    size_t cap = barph_compress_bound(len);
+    size_t packed_len = 0;
+    e->packed = (uint8_t *)malloc(cap);
+    int failed = !e->packed || barph_compress_into(&ctx, data, len, do_rle, do_huff, do_diff, e->packed, cap, &packed_len) != 0;
+    e->packed_len = packed_len;
+    barph_ctx_free(&ctx);
+    barph_file_close(&in);
+    e->failed = failed;
+}
+
+// packs the files in the directory in, or listed in the file in one per line, into the archive at out_path
+// files are read and compressed a batch at a time, a file per thread, and written in order of their names, so the archive doesn't depend on the number of threads
+static int archive_pack(archive_t * a, const char * in, const char * out_path, size_t thread_count)
+{
+    int failed = 0;
+#if defined(_WIN32)
+    DWORD attributes = GetFileAttributesA(in);
+    int is_dir = attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+    struct stat info;
+    int is_dir = stat(in, &info) == 0 && S_ISDIR(info.st_mode);
+#endif
+    if (is_dir)
+        failed = archive_walk(a, in, strlen(in) + 1);
+    else
+    {
+        FILE * f = fopen(in, "rb");
+        if (!f)
+        {
+            fprintf(stderr, "error: failed to open %s\n", in);
+            return -1;
+        }
+        byte_buffer_t list = {0, 0, 0, 0};
+        list = read_all(f, list);
+        fclose(f);
+        if (bytes_push(&list, (const uint8_t *)"\n", 1) != 0)
+        {
+            fprintf(stderr, "error: out of memory\n");
+            free(list.data);
+            return -1;
+        }
+        char * line = (char *)list.data;
+        for (size_t i = 0; i < list.len && !failed; i++)
+        {
+            if (list.data[i] != '\n')
+                continue;
+            list.data[i] = 0;
+            if (i > 0 && list.data[i - 1] == '\r')
+                list.data[i - 1] = 0;
+            if (*line)
+                failed = archive_add(a, line, line);
+            line = (char *)&list.data[i + 1];
+        }
+        free(list.data);
+    }
+    if (failed)
+        return -1;
+    
+    qsort(a->entries, a->count, sizeof(archive_entry_t), archive_name_compare);
+    const char * clash = archive_name_clash(a);
+    if (clash)
+    {
+        fprintf(stderr, "error: %s is listed more than once, or is in a directory with the same name as a file\n", clash);
+        return -1;
+    }
+    if (a->count > UINT32_MAX)
+    {
+        fprintf(stderr, "error: too many files\n");
+        return -1;
+    }
+    
+    FILE * f = fopen(out_path, "wb");
+    if (!f)
+    {
+        fprintf(stderr, "error: failed to open %s\n", out_path);
+        return -1;
+    }
+    fwrite("bRPA", 1, 4, f);
+    uint64_t offset = 4;
+    for (size_t first = 0; first < a->count && !failed;)
+    {
+        size_t n = 0;
+        uint64_t batch_bytes = 0;
+        while (first + n < a->count && (n == 0 || batch_bytes + a->entries[first + n].raw_len <= ARCHIVE_BATCH_BYTES))
+            batch_bytes += a->entries[first + n++].raw_len;
+        a->first = first;
+        barph_parallel_for(n, thread_count, archive_pack_task, a);
+        
+        for (size_t i = first; i < first + n; i++)
+        {
+            archive_entry_t * e = &a->entries[i];
+            if (e->failed && !failed)
+                fprintf(stderr, "error: failed to read or compress %s\n", e->path);
+            failed |= e->failed;
+            if (!failed)
+                fwrite(e->packed, 1, e->packed_len, f);
+            e->offset = offset;
+            offset += e->packed_len;
+            free(e->packed);
+            e->packed = 0;
+        }
+        first += n;
+    }
+    
+    byte_buffer_t dir = {0, 0, 0, 0};
+    int dir_failed = 0;
+    for (size_t i = 0; i < a->count; i++)
+    {
+        const archive_entry_t * e = &a->entries[i];
+        size_t name_len = strlen(e->name);
+        uint8_t name_len_bytes[2] = {(uint8_t)name_len, (uint8_t)(name_len >> 8)};
+        dir_failed |= bytes_push_u64(&dir, e->offset);
+        dir_failed |= bytes_push_u64(&dir, e->packed_len);
+        dir_failed |= bytes_push_u64(&dir, e->raw_len);
+        dir_failed |= bytes_push(&dir, name_len_bytes, 2);
+        dir_failed |= bytes_push(&dir, (const uint8_t *)e->name, name_len);
+    }
+    uint32_t checksum = barph_checksum(dir.data, dir.len);
+    dir_failed |= bytes_push_u64(&dir, offset);
+    dir_failed |= bytes_push_u32(&dir, (uint32_t)a->count);
+    dir_failed |= bytes_push_u32(&dir, checksum);
+    if (dir_failed && !failed)
+        fprintf(stderr, "error: out of memory\n");
+    failed |= dir_failed;
+    if (!failed)
+        fwrite(dir.data, 1, dir.len, f);
+    free(dir.data);
+    int written = !ferror(f);
+    written = fclose(f) == 0 && written;
+    if (!failed && !written)
+        fprintf(stderr, "error: failed to write %s\n", out_path);
+    if (failed || !written)
+    {
+        remove(out_path);
+        return -1;
+    }
+    return 0;
+}
+
+// reads the directory of the archive at a->archive_path; returns nonzero if it isn't a valid archive
+static int archive_read(archive_t * a)
+{
+    FILE * f = fopen(a->archive_path, "rb");
+    if (!f)
+    {
+        fprintf(stderr, "error: failed to open %s\n", a->archive_path);
+        return -1;
+    }
+    uint8_t trailer[ARCHIVE_TRAILER_SIZE];
+    file_seek(f, 0, SEEK_END);
+    uint64_t file_len = file_tell(f);
+    int failed = file_len < 4 + ARCHIVE_TRAILER_SIZE || file_seek(f, 0, SEEK_SET) != 0 || fread(trailer, 1, 4, f) != 4 || memcmp(trailer, "bRPA", 4) != 0 ||
+        file_seek(f, file_len - ARCHIVE_TRAILER_SIZE, SEEK_SET) != 0 || fread(trailer, 1, ARCHIVE_TRAILER_SIZE, f) != ARCHIVE_TRAILER_SIZE;
+    
+    uint64_t dir_offset = failed ? 0 : load_u64le(trailer);
+    uint64_t count = failed ? 0 : load_u32le(&trailer[8]);
+    uint64_t dir_len = file_len - ARCHIVE_TRAILER_SIZE - dir_offset;
+    failed |= dir_offset < 4 || dir_offset > file_len - ARCHIVE_TRAILER_SIZE || dir_len > SIZE_MAX || count * ARCHIVE_ENTRY_SIZE > dir_len;
+    
+    uint8_t * dir = (uint8_t *)malloc(failed || !dir_len ? 1 : dir_len);
+    failed = failed || !dir || file_seek(f, dir_offset, SEEK_SET) != 0 || fread(dir, 1, dir_len, f) != dir_len || barph_checksum(dir, dir_len) != load_u32le(&trailer[12]);
+    fclose(f);
+    
+    size_t pos = 0;
+    if (!failed)
+    {
+        a->entries = (archive_entry_t *)calloc(count ? count : 1, sizeof(archive_entry_t));
+        a->cap = count;
+        failed = !a->entries;
+    }
+    for (size_t i = 0; i < count && !failed; i++)
+    {
+        if (dir_len - pos < ARCHIVE_ENTRY_SIZE)
+        {
+            failed = 1;
+            break;
+        }
+        archive_entry_t * e = &a->entries[a->count];
+        e->offset = load_u64le(&dir[pos]);
+        e->packed_len = load_u64le(&dir[pos + 8]);
+        e->raw_len = load_u64le(&dir[pos + 16]);
+        size_t name_len = dir[pos + 24] | (dir[pos + 25] << 8);
+        pos += ARCHIVE_ENTRY_SIZE;
+        if (dir_len - pos < name_len || e->offset < 4 || e->packed_len > dir_offset || e->offset > dir_offset - e->packed_len)
+        {
+            failed = 1;
+            break;
+        }
+        e->name = copy_string((const char *)&dir[pos], name_len);
+        if (!e->name)
+        {
+            failed = 1;
+            break;
+        }
+        a->count += 1;
+        pos += name_len;
+        failed |= strlen(e->name) != name_len || !archive_name_ok(e->name);
+    }
+    free(dir);
+    // packing writes the files in order of their names, and a name that clashes with another would have threads unpacking into the same file
+    if (failed || pos != dir_len || archive_name_clash(a))
+    {
+        fprintf(stderr, "error: %s isn't a valid archive\n", a->archive_path);
+        return -1;
+    }
+    return 0;
+}
+
+// makes the directories leading up to the file at path; ones that already exist are left alone
+static void make_parents(char * path)
+{
+    for (char * c = path + 1; *c; c++)
+    {
+        if (*c != '/')
+            continue;
+        *c = 0;
+        make_dir(path);
+        *c = '/';
+    }
+}
+
+static void archive_unpack_task(void * userdata, size_t index)
+{
+    archive_t * a = (archive_t *)userdata;
+    archive_entry_t * e = &a->entries[a->first + index];
+    e->failed = 1;
+    // each thread reads through its own handle, so that they don't share a file position
+    FILE * f = fopen(a->archive_path, "rb");
+    if (!f)
+        return;
+    size_t packed_len = e->packed_len;
+    uint8_t * packed = (uint8_t *)malloc(packed_len ? packed_len : 1);
+    int ok = packed && file_seek(f, e->offset, SEEK_SET) == 0 && fread(packed, 1, packed_len, f) == packed_len;
+    fclose(f);
+    uint32_t id;
+    uint64_t size;
+    ok = ok && (barph_dict_id(packed, packed_len, &id) != 0 || (a->dict && id == a->dict->id));
+    ok = ok && barph_decompressed_size(packed, packed_len, &size) == 0 && size == e->raw_len && size <= SIZE_MAX;
+    
+    // files are decompressed straight into their output files, mapped at their final size
+    barph_file_t out;
+    if (ok)
+    {
+        make_parents(e->path);
+        if (barph_file_create(&out, e->path, (size_t)size) != 0)
+        {
+            e->failed = 2;
+            ok = 0;
+        }
+    }
+    if (ok)
+    {
+        size_t len = 0;
+        barph_ctx_t ctx;
+        barph_ctx_init(&ctx);
+        ctx.dict = a->dict;
+        ok = barph_decompress_into(&ctx, packed, packed_len, out.data, out.len, &len) == 0 && len == out.len;
+        barph_ctx_free(&ctx);
+        int write_failed = barph_file_close(&out) != 0;
+        e->failed = !ok ? 1 : write_failed ? 2 : 0;
+        if (e->failed)
+            remove(e->path);
+    }
+    free(packed);
+}
+
+// unpacks every file in the archive into the directory out, several at once, or only the file called name into the file out
+static int archive_unpack(archive_t * a, const char * out, const char * name, size_t thread_count)
+{
+    if (archive_read(a) != 0)
+        return -1;
+    size_t first = 0;
+    size_t count = a->count;
+    if (name)
+    {
+        while (first < a->count && strcmp(a->entries[first].name, name) != 0)
+            first += 1;
+        if (first == a->count)
+        {
+            fprintf(stderr, "error: %s isn't in the archive\n", name);
+            return -1;
+        }
+        a->entries[first].path = copy_string(out, strlen(out));
+        if (!a->entries[first].path)
+        {
+            fprintf(stderr, "error: out of memory\n");
+            return -1;
+        }
+        count = 1;
+    }
+    else
+    {
+        make_dir(out);
+        for (size_t i = 0; i < a->count; i++)
+        {
+            archive_entry_t * e = &a->entries[i];
+            size_t out_len = strlen(out);
+            e->path = (char *)malloc(out_len + strlen(e->name) + 2);
+            if (!e->path)
+            {
+                fprintf(stderr, "error: out of memory\n");
+                return -1;
+            }
+            sprintf(e->path, "%s/%s", out, e->name);
+        }
+    }
+    a->first = first;
+    barph_parallel_for(count, thread_count, archive_unpack_task, a);
+    
+    int failed = 0;
+    for (size_t i = first; i < first + count; i++)
+    {
+        archive_entry_t * e = &a->entries[i];
+        if (e->failed == 1)
+            fprintf(stderr, "error: %s is corrupt, failed checksum validation, or needs a dictionary given with -D\n", e->name);
+        else if (e->failed)
+            fprintf(stderr, "error: failed to write %s\n", e->path);
+        failed |= e->failed;
+    }
+    return failed ? -1 : 0;
+}
+
+// lists the files in the archive: their names, sizes and compressed sizes, tab-separated
+static int archive_list(archive_t * a)
+{
+    if (archive_read(a) != 0)
+        return -1;
+    for (size_t i = 0; i < a->count; i++)
+    {
+        const archive_entry_t * e = &a->entries[i];
+        printf("%s\t%llu\t%llu\n", e->name, (unsigned long long)e->raw_len, (unsigned long long)e->packed_len);
+    }
+    return 0;
+}
+
 int main(int argc, char ** argv)
 {
-    if (argc < 3 || (argv[1][0] != 'z' && argv[1][0] != 'x'))
+    // pull options out, leaving the positional arguments in order
+    size_t thread_count = 0;
+    size_t block_size = 0;
+    int use_blocks = 0;
+    int use_stream = 0;
+    const char * dict_path = 0;
+    int use_auto = 0;
+    int use_range = 0;
+    int bad_range = 0;
+    uint64_t range_offset = 0;
+    size_t range_len = 0;
+    size_t lz_window = 0;
+    size_t planes = 0;
+    size_t huff_threads = 1;
+    barph_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    barph_stats_t * use_stats = 0;
+    char * args[7];
+    int arg_count = 0;
+    for (int i = 0; i < argc; i++)
     {
-        puts("usage: barph (z|x) <in> <out> [0|1] [0|1] [number]");
+        if (argv[i][0] == '-' && argv[i][1] == 't' && i + 1 < argc)
+        {
+            thread_count = strtol(argv[++i], 0, 10);
+            use_blocks = 1;
+        }
+        else if (argv[i][0] == '-' && argv[i][1] == 'b' && i + 1 < argc)
+        {
+            block_size = strtol(argv[++i], 0, 10) * 1024;
+            use_blocks = 1;
+        }
+        else if (argv[i][0] == '-' && argv[i][1] == 's' && argv[i][2] == 0)
+            use_stream = 1;
+        else if (argv[i][0] == '-' && argv[i][1] == 'D' && i + 1 < argc)
+            dict_path = argv[++i];
+        else if (argv[i][0] == '-' && argv[i][1] == 'a' && argv[i][2] == 0)
+            use_auto = 1;
+        else if (argv[i][0] == '-' && argv[i][1] == 'r' && i + 1 < argc)
+        {
+            bad_range |= parse_range(argv[++i], &range_offset, &range_len) != 0;
+            use_range = 1;
+        }
+        else if (argv[i][0] == '-' && argv[i][1] == 'w' && i + 1 < argc)
+            lz_window = strtol(argv[++i], 0, 10) * 1024;
+        else if (argv[i][0] == '-' && argv[i][1] == 'p' && i + 1 < argc)
+            planes = strtol(argv[++i], 0, 10);
+        else if (argv[i][0] == '-' && argv[i][1] == 'j' && i + 1 < argc)
+            huff_threads = strtol(argv[++i], 0, 10);
+        else if (strcmp(argv[i], "--stats") == 0)
+            use_stats = &stats;
+        else if (arg_count < 7)
+            args[arg_count++] = argv[i];
+    }
+    
+    char mode = arg_count > 1 ? args[1][0] : 0;
+    if (arg_count < (mode == 'l' ? 3 : 4) || (mode != 'z' && mode != 'x' && mode != 'd' && mode != 'a' && mode != 'u' && mode != 'l') || bad_range)
+    {
+        if (bad_range)
+            fprintf(stderr, "error: -r takes an offset and a length, like -r 1024,4096\n");
+        puts("usage: barph (z|x|d|a|u|l) <in> <out> [0|1|2] [0|1|2|3|4|5] [number] [-t threads] [-b block_kb] [-s] [-D dict] [-w window_kb] [-p sample_bytes] [-j threads] [-a] [-r offset,length] [--stats]");
         puts("z: compress <in> into <out>");
         puts("x: decompress <in> into <out>");
-        puts("The three numeric arguments at the end are for z (compress) mode.");
-        puts("The first turns on RLE. RLE alone can give up to a 1:127 compression ratio, at most.");
-        puts("The second turns on Huffman coding. Huffman coding alone can give up to a 1:8 compression ratio, at most.");
+        puts("d: train a Huffman dictionary on the sample data in <in>, and save it into <out>");
+        puts("a: pack the files in the directory <in> and its subdirectories, or the files listed in <in> one per line, into the archive <out>. Each file is compressed on its own, several at once.");
+        puts("u: unpack every file in the archive <in> into the directory <out>, several at once, or, given a name after <out>, only that file, into the file <out>");
+        puts("l: list the files in the archive <in>, with their sizes and compressed sizes; doesn't take <out>");
+        puts("The three numeric arguments at the end are for z (compress) and a (archive) modes. d mode uses the first and third, which should match the ones the dictionary will be used with.");
+        puts("The first turns on RLE. RLE alone can give up to a 1:127 compression ratio, at most. 2 uses LZ77 instead, which finds repeats of earlier data rather than just runs, and works better for text and executables, but compresses slower.");
+        puts("The second turns on Huffman coding. Huffman coding alone can give up to a 1:8 compression ratio, at most. 2 stores the Huffman code compactly; 1 stores it in the original format, for older decoders. 3 is like 2, but splits the data into four streams, which decode faster. 4 uses the dictionary given with -D instead of storing a code. 5 uses tANS instead, which isn't limited to whole bits per byte, so it does better on data that's mostly the same few bytes, and decodes faster, but compresses slower.");
         puts("The third turns on delta coding, with a byte distance. 3 works good for 3-channel RGB images, 4 works good for 3-channel RGBA images or 16-bit PCM audio. Only if they're not already compressed, though. Does not generally work well with most files, like text.");
-        puts("If given, the numeric arguments must be given in order. If not given, their defaults are 1, 1, 0. In other words, RLE and Huffman are enabled by default, but delta coding is not.");
+        puts("If given, the numeric arguments must be given in order. If not given, their defaults are 1, 2, 0. In other words, RLE and Huffman are enabled by default, but delta coding is not.");
+        puts("-t: number of threads to use; 0, the default, means one per core. In z mode, this splits the input into independently compressed blocks. The output is the same no matter how many threads are used. In a and u modes, it's how many files are packed or unpacked at once.");
+        puts("-b: block size in KiB for z mode, 1024 by default. Also turns on blocks.");
+        puts("-s: stream, one block at a time, without holding the whole file in memory. Always used when <in> or <out> is -, meaning stdin or stdout.");
+        puts("-D: dictionary file from d mode. In z and a modes, turns on Huffman mode 4 (unless Huffman coding is off); in x and u modes, needed for files made with it. Can't be used with blocks.");
+        puts("-w: how far back LZ77 (RLE mode 2) looks for repeats, in KiB, for z and a modes; 64 by default, and up to 16384. Can't be used with blocks.");
+        puts("-p: for z and a modes, split the input into byte planes for samples of this many bytes (up to 16), which are RLE and Huffman coded separately, each with its own code: 2 for 16-bit audio, 4 for RGBA images. Use a delta distance of the same number for delta coding within each plane. Can't be used with blocks.");
+        puts("-j: number of threads to code a single Huffman stream across in z mode, without splitting the input into blocks; 0 means one per core. The output is the same as with one thread, so older versions of barph can read it. Only Huffman modes 1 and 2 are split, and only inputs of a few MiB or more gain from it.");
+        puts("-a: pick the three numeric arguments for z mode automatically, from samples of <in>, or from its first MiB when streaming. In a mode, they're picked for each file. Given numeric arguments are ignored.");
+        puts("-r: in x mode, decompress only the given range of bytes. Block containers and streams only decompress the blocks that cover it, but aren't checked against their checksum.");
+        puts("--stats: print the time and bytes of each stage, RLE run and literal lengths, Huffman code lengths, and memory use to stderr. Block containers only give the total time.");
+        return bad_range ? -1 : 0;
+    }
+    
+    if (mode == 'a' || mode == 'u' || mode == 'l')
+    {
+        barph_dict_t dict;
+        if (dict_path)
+            load_dict(&dict, dict_path);
+        if (planes > BARPH_MAX_PLANES)
+        {
+            puts("error: -p can't be more than 16");
+            return 0;
+        }
+        
+        archive_t a;
+        memset(&a, 0, sizeof(a));
+        a.flags[0] = arg_count > 4 ? strtol(args[4], 0, 10) : 1;
+        a.flags[1] = arg_count > 5 ? strtol(args[5], 0, 10) : 2;
+        a.flags[2] = arg_count > 6 ? strtol(args[6], 0, 10) : 0;
+        a.use_auto = use_auto;
+        a.dict = dict_path ? &dict : 0;
+        a.lz_window = lz_window;
+        a.planes = planes;
+        a.archive_path = mode == 'a' ? args[3] : args[2];
+        
+        int failed;
+        if (mode == 'a')
+            failed = archive_pack(&a, args[2], args[3], thread_count);
+        else if (mode == 'u')
+            failed = archive_unpack(&a, args[3], arg_count > 4 ? args[4] : 0, thread_count);
+        else
+            failed = archive_list(&a);
+        archive_free(&a);
+        if (failed)
+            exit(-1);
         return 0;
     }
-    FILE * f = fopen(argv[2], "rb");
+    
+    FILE * f = strcmp(args[2], "-") == 0 ? stdin : fopen(args[2], "rb");
     if (!f)
     {
         puts("error: failed to open input file");
         return 0;
     }
-    fseek(f, 0, SEEK_END);
-    size_t file_len = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    
-    uint8_t * raw_data = (uint8_t *)malloc(file_len);
-    fread(raw_data, file_len, 1, f);
-    byte_buffer_t buf = {raw_data, file_len, file_len};
+    FILE * f2 = strcmp(args[3], "-") == 0 ? stdout : 0;
+    if (f == stdin || f2 == stdout)
+        use_stream = 1;
+#if defined(_WIN32)
+    _setmode(_fileno(stdin), _O_BINARY);
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
     
-    fclose(f);
+    barph_dict_t dict;
+    if (dict_path)
+        load_dict(&dict, dict_path);
     
-    if (argv[1][0] == 'z')
+    if (args[1][0] == 'd')
+    {
+        uint8_t do_rle = arg_count > 4 ? strtol(args[4], 0, 10) : 1;
+        uint8_t do_diff = arg_count > 6 ? strtol(args[6], 0, 10) : 0;
+        
+        byte_buffer_t buf = {0, 0, 0, 0};
+        buf = read_all(f, buf);
+        fclose(f);
+        
+        uint64_t counts[256] = {0};
+        barph_ctx_t ctx;
+        barph_ctx_init(&ctx);
+        int failed = barph_dict_count(&ctx, counts, buf.data, buf.len, do_rle, do_diff);
+        barph_ctx_free(&ctx);
+        barph_dict_build(&dict, counts);
+        
+        buf.len = 0;
+        if (failed || barph_dict_save(&dict, &buf) != 0)
+        {
+            fprintf(stderr, "error: out of memory");
+            exit(-1);
+        }
+        if (!f2)
+            f2 = fopen(args[3], "wb");
+        fwrite(buf.data, buf.len, 1, f2);
+        fclose(f2);
+        free(buf.data);
+    }
+    else if (args[1][0] == 'z')
     {
         uint8_t do_diff = 0;
         uint8_t do_rle = 1;
-        uint8_t do_huff = 1;
-        
-        if (argc > 4)
-            do_rle = strtol(argv[4], 0, 10);
-        if (argc > 5)
-            do_huff = strtol(argv[5], 0, 10);
-        if (argc > 6)
-            do_diff = strtol(argv[6], 0, 10);
+        uint8_t do_huff = 2;
         
-        buf.data = barph_compress(buf.data, buf.len, do_rle, do_huff, do_diff, &buf.len);
+        if (arg_count > 4)
+            do_rle = strtol(args[4], 0, 10);
+        if (arg_count > 5)
+            do_huff = strtol(args[5], 0, 10);
+        if (arg_count > 6)
+            do_diff = strtol(args[6], 0, 10);
+        if (dict_path && do_huff)
+            do_huff = BARPH_HUFF_DICT;
+        if (dict_path && use_blocks)
+        {
+            puts("error: dictionaries can't be used with blocks");
+            return 0;
+        }
+        if ((lz_window || planes) && use_blocks)
+        {
+            puts(lz_window ? "error: -w can't be used with blocks" : "error: -p can't be used with blocks");
+            return 0;
+        }
+        if (planes > BARPH_MAX_PLANES)
+        {
+            puts("error: -p can't be more than 16");
+            return 0;
+        }
         
-        FILE * f2 = fopen(argv[3], "wb");
+        if (use_stream)
+        {
+            if (!f2)
+                f2 = fopen(args[3], "wb");
+            
+            // only the start of a stream can be sampled
+            byte_buffer_t first = {0, 0, 0, 0};
+            if (use_auto)
+            {
+                bytes_reserve(&first, 1 << 20);
+                first.len = fread(first.data, 1, 1 << 20, f);
+                choose_flags(first.data, first.len, &do_rle, &do_huff, &do_diff);
+                if (dict_path && do_huff)
+                    do_huff = BARPH_HUFF_DICT;
+            }
+            
+            double start = barph_now();
+            barph_encoder_t e;
+            barph_encoder_init(&e, do_rle, do_huff, do_diff, block_size, dict_path ? &dict : 0, write_to_file, f2);
+            e.ctx.stats = use_stats;
+            if (lz_window)
+                e.ctx.lz_window = lz_window;
+            e.ctx.planes = planes;
+            e.ctx.threads = huff_threads;
+            int failed = barph_encoder_feed(&e, first.data, first.len);
+            free(first.data);
+            uint8_t * chunk = (uint8_t *)malloc(1 << 16);
+            size_t n;
+            while (!failed && (n = fread(chunk, 1, 1 << 16, f)) > 0)
+                failed = barph_encoder_feed(&e, chunk, n);
+            if (barph_encoder_finish(&e) != 0 || failed)
+            {
+                fprintf(stderr, "error: out of memory");
+                exit(-1);
+            }
+            free(chunk);
+            
+            fclose(f);
+            fclose(f2);
+            if (use_stats)
+            {
+                stats.seconds = barph_now() - start;
+                print_stats(&stats);
+            }
+            return 0;
+        }
         
-        fwrite(buf.data, buf.len, 1, f2);
+        // the file API maps the input, and feeds it to the stages where it is, unless delta coding is going to rewrite all of it
+        fclose(f);
+        if (use_auto)
+        {
+            barph_file_t in;
+            if (barph_file_read(&in, args[2], 0) != 0)
+            {
+                puts("error: failed to read input file");
+                return 0;
+            }
+            choose_flags(in.data, in.len, &do_rle, &do_huff, &do_diff);
+            if (dict_path && do_huff)
+                do_huff = BARPH_HUFF_DICT;
+            barph_file_close(&in);
+        }
         
-        fclose(f2);
+        double start = barph_now();
+        int failed;
+        if (use_blocks)
+        {
+            barph_file_t in;
+            if (barph_file_read(&in, args[2], do_diff != 0) != 0)
+            {
+                puts("error: failed to read input file");
+                return 0;
+            }
+            size_t out_len;
+            uint8_t * out = barph_compress_blocks(in.data, in.len, do_rle, do_huff, do_diff, block_size, thread_count, &out_len);
+            barph_file_close(&in);
+            failed = !out || barph_write_file(args[3], 0, out, out_len) != 0;
+            free(out);
+        }
+        else
+        {
+            barph_ctx_t ctx;
+            barph_ctx_init(&ctx);
+            ctx.dict = dict_path ? &dict : 0;
+            ctx.stats = use_stats;
+            if (lz_window)
+                ctx.lz_window = lz_window;
+            ctx.planes = planes;
+            ctx.threads = huff_threads;
+            // files made with a dictionary, a window or planes store their length, so they can be decompressed straight into the output file;
+            // Huffman threads don't change the output, so it's the same file as without them, which older versions can read
+            failed = barph_compress_file(&ctx, args[2], args[3], do_rle, do_huff, do_diff, dict_path || lz_window || planes);
+            barph_ctx_free(&ctx);
+        }
+        stats.seconds = barph_now() - start;
+        if (failed)
+        {
+            fprintf(stderr, "error: failed to write output file");
+            exit(-1);
+        }
+        if (use_stats)
+            print_stats(&stats);
     }
-    else if (argv[1][0] == 'x')
+    else if (args[1][0] == 'x')
     {
-        buf.data = barph_decompress(buf.data, buf.len, &buf.len);
+        // streamed files can be decompressed as they're read; anything else has to be read in whole first
+        byte_buffer_t buf = {0, 0, 0, 0};
+        if (bytes_reserve(&buf, BARPH_HEADER_SIZE) != 0)
+        {
+            fprintf(stderr, "error: out of memory");
+            exit(-1);
+        }
+        buf.len = fread(buf.data, 1, BARPH_HEADER_SIZE, f);
         
-        if (buf.data)
+        if (buf.len == BARPH_HEADER_SIZE && (buf.data[4] & BARPH_FLAG_STREAM) && !use_range)
         {
-            FILE * f2 = fopen(argv[3], "wb");
-            fwrite(buf.data, buf.len, 1, f2);
+            if (!f2)
+                f2 = fopen(args[3], "wb");
+            
+            double start = barph_now();
+            barph_decoder_t d;
+            barph_decoder_init(&d, dict_path ? &dict : 0, write_to_file, f2);
+            d.ctx.stats = use_stats;
+            int failed = barph_decoder_feed(&d, buf.data, buf.len);
+            uint8_t * chunk = (uint8_t *)malloc(1 << 16);
+            size_t n;
+            while (!failed && (n = fread(chunk, 1, 1 << 16, f)) > 0)
+                failed = barph_decoder_feed(&d, chunk, n);
+            free(chunk);
+            free(buf.data);
+            if (barph_decoder_finish(&d) != 0 || failed)
+            {
+                fprintf(stderr, "error: stream is corrupt or checksum validation failed");
+                exit(-1);
+            }
+            fclose(f);
             fclose(f2);
+            if (use_stats)
+            {
+                stats.seconds = barph_now() - start;
+                print_stats(&stats);
+            }
+            return 0;
+        }
+        
+        // anything else is read whole: stdin here, and files by the file API, which maps them; of those, only the start is read here, to be checked
+        barph_file_t in;
+        memset(&in, 0, sizeof(in));
+        if (f == stdin)
+        {
+            buf = read_all(f, buf);
+            in.data = buf.data;
+            in.len = buf.len;
         }
         else
         {
-            fprintf(stderr, "error: checksum validation failed");
+            bytes_reserve(&buf, 64);
+            buf.len += fread(&buf.data[buf.len], 1, 64, f);
+            fclose(f);
+        }
+        if (barph_check_header(buf.data, buf.len) != 0)
+        {
+            fprintf(stderr, "error: invalid barph file");
+            exit(-1);
+        }
+        uint32_t id;
+        if (barph_dict_id(buf.data, buf.len, &id) == 0 && (!dict_path || id != dict.id))
+        {
+            fprintf(stderr, dict_path ? "error: <in> was compressed with a different dictionary" : "error: <in> was compressed with a dictionary; give it with -D");
             exit(-1);
         }
+        if (f != stdin)
+            free(buf.data);
+        
+        double start = barph_now();
+        barph_ctx_t ctx;
+        barph_ctx_init(&ctx);
+        ctx.dict = dict_path ? &dict : 0;
+        ctx.stats = use_stats;
+        ctx.threads = thread_count;
+        // stdout can't be mapped, so output for it goes through the file API's stdio path
+        const char * out_path = f2 ? 0 : args[3];
+        int failed;
+        if (use_range)
+        {
+            if (f != stdin && barph_file_read(&in, args[2], 0) != 0)
+            {
+                puts("error: failed to read input file");
+                return 0;
+            }
+            uint8_t * out = (uint8_t *)malloc(range_len ? range_len : 1);
+            size_t out_len;
+            failed = !out || barph_decompress_range(&ctx, in.data, in.len, range_offset, range_len, out, &out_len) != 0 || barph_write_file(out_path, f2, out, out_len) != 0;
+            free(out);
+        }
+        else if (f == stdin)
+            failed = barph_decompress_to_file(&ctx, in.data, in.len, out_path, f2);
+        else
+            failed = barph_decompress_file(&ctx, args[2], out_path, f2);
+        barph_ctx_free(&ctx);
+        barph_file_close(&in);
+        stats.seconds = barph_now() - start;
+        if (failed)
+        {
+            fprintf(stderr, "error: checksum validation failed, or failed to write output file");
+            exit(-1);
+        }
+        if (use_stats)
+            print_stats(&stats);
     }
-    
-    free(buf.data);
-}
\ No newline at end of file
+}
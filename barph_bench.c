@@ -0,0 +1,303 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// every allocation barph makes goes through here, so that its peak heap use can be measured
+// the size is stored in front of each allocation, since free and realloc aren't given it
+static size_t heap_current = 0;
+static size_t heap_peak = 0;
+
+static void * bench_realloc(void * p, size_t n)
+{
+    size_t * block = p ? ((size_t *)p) - 2 : 0;
+    if (block)
+        heap_current -= block[0];
+    block = (size_t *)realloc(block, n + sizeof(size_t) * 2);
+    block[0] = n;
+    heap_current += n;
+    if (heap_current > heap_peak)
+        heap_peak = heap_current;
+    return block + 2;
+}
+static void * bench_malloc(size_t n)
+{
+    return bench_realloc(0, n);
+}
+static void bench_free(void * p)
+{
+    if (!p)
+        return;
+    size_t * block = ((size_t *)p) - 2;
+    heap_current -= block[0];
+    free(block);
+}
+
+#define BARPH_REALLOC bench_realloc
+#define BARPH_MALLOC bench_malloc
+#define BARPH_FREE bench_free
+
+#include "barph_impl.h"
+
+#if defined(_WIN32)
+static double bench_now(void)
+{
+    LARGE_INTEGER freq, t;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&t);
+    return (double)t.QuadPart / (double)freq.QuadPart;
+}
+#else
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+static double bench_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+#endif
+
+typedef struct {
+    const char * file;
+    uint8_t flags[3];
+    size_t runs;
+} bench_t;
+
+// one line per stage, tab-separated, under the header printed by main
+// throughput is measured on the uncompressed side of each stage, and peak_bytes is the most heap that barph held at once while running it
+static void report(const bench_t * b, const char * stage, size_t in_len, size_t out_len, size_t raw_len, double seconds, size_t peak)
+{
+    printf("%s\tr%dh%dd%d\t%s\t%zu\t%zu\t%.4f\t%.1f\t%zu\n", b->file, b->flags[0], b->flags[1], b->flags[2], stage,
+        in_len, out_len, in_len ? (double)out_len / in_len : 0.0, seconds > 0 ? raw_len / seconds / 1e6 : 0.0, peak);
+}
+
+// times `body` over b->runs runs, keeping the fastest, after running `setup` untimed before each run
+#define BENCH_STAGE(setup, body) \
+    do { \
+        best = 1e30; \
+        peak = 0; \
+        for (size_t run = 0; run < b->runs; run++) \
+        { \
+            setup; \
+            size_t base = heap_current; \
+            heap_peak = heap_current; \
+            double t = bench_now(); \
+            body; \
+            t = bench_now() - t; \
+            if (t < best) \
+                best = t; \
+            if (heap_peak - base > peak) \
+                peak = heap_peak - base; \
+        } \
+    } while (0)
+
+// runs each stage on its own, then the whole pipeline, over data with the given flags; returns nonzero if anything didn't round trip
+static int bench_file(const bench_t * b, const uint8_t * data, size_t len)
+{
+    uint8_t do_rle = b->flags[0];
+    uint8_t do_huff = barph_huff_mode(0, b->flags[1]);
+    uint8_t do_diff = b->flags[2];
+    double best;
+    size_t peak;
+    int failed = 0;
+    
+    byte_buffer_t delta = {0, 0, 0, 0};
+    byte_buffer_t rle = {0, 0, 0, 0};
+    byte_buffer_t packed = {0, 0, 0, 0};
+    byte_buffer_t unpacked = {0, 0, 0, 0};
+    byte_buffer_t unrle = {0, 0, 0, 0};
+    byte_buffer_t tables = {0, 0, 0, 0};
+    huff_table_t * table = (huff_table_t *)malloc(sizeof(huff_table_t));
+    
+    bytes_push(&delta, data, len);
+    if (do_diff)
+    {
+        BENCH_STAGE(memcpy(delta.data, data, len), barph_delta_encode(delta.data, len, do_diff, 0, 0));
+        report(b, "delta_encode", len, len, len, best, peak);
+    }
+    
+    byte_buffer_t stage = delta;
+    if (do_rle)
+    {
+        BENCH_STAGE(rle.len = 0, failed |= barph_rle_compress(&rle, &tables, stage.data, stage.len, do_rle, 0));
+        report(b, do_rle == BARPH_RLE_LZ ? "lz_compress" : "rle_compress", stage.len, rle.len, stage.len, best, peak);
+        stage = rle;
+    }
+    if (do_huff)
+    {
+        BENCH_STAGE(packed.len = 0, failed |= huff_pack(&packed, stage.data, stage.len, do_huff));
+        report(b, "huff_pack", stage.len, packed.len, stage.len, best, peak);
+        
+        BENCH_STAGE((void)0, failed |= huff_unpack(&unpacked, table, packed.data, packed.len, do_huff, stage.len));
+        report(b, "huff_unpack", packed.len, unpacked.len, unpacked.len, best, peak);
+        failed |= unpacked.len != stage.len || memcmp(unpacked.data, stage.data, stage.len) != 0;
+    }
+    if (do_rle)
+    {
+        BENCH_STAGE((void)0, failed |= barph_rle_decompress(&unrle, rle.data, rle.len, do_rle));
+        report(b, do_rle == BARPH_RLE_LZ ? "lz_decompress" : "rle_decompress", rle.len, unrle.len, unrle.len, best, peak);
+        failed |= unrle.len != len || memcmp(unrle.data, delta.data, len) != 0;
+    }
+    if (do_diff)
+    {
+        BENCH_STAGE((unrle.len = 0, bytes_push(&unrle, delta.data, len)), barph_delta_decode(unrle.data, len, do_diff, 0, 0));
+        report(b, "delta_decode", len, len, len, best, peak);
+        failed |= memcmp(unrle.data, data, len) != 0;
+    }
+    
+    volatile uint64_t sink = 0;
+    BENCH_STAGE((void)0, sink = sink + barph_checksum(data, len));
+    report(b, "checksum", len, len, len, best, peak);
+    BENCH_STAGE((void)0, sink = sink + barph_hash(data, len));
+    report(b, "hash", len, len, len, best, peak);
+    (void)sink;
+    
+    // the whole pipeline, through the public API
+    size_t compressed_len = 0;
+    uint8_t * compressed = 0;
+    BENCH_STAGE((bench_free(compressed), memcpy(delta.data, data, len)), compressed = barph_compress(delta.data, len, do_rle, do_huff, do_diff, &compressed_len));
+    report(b, "compress", len, compressed_len, len, best, peak);
+    
+    size_t decompressed_len = 0;
+    uint8_t * decompressed = 0;
+    BENCH_STAGE(bench_free(decompressed), decompressed = barph_decompress(compressed, compressed_len, &decompressed_len));
+    report(b, "decompress", compressed_len, decompressed_len, decompressed_len, best, peak);
+    failed |= !decompressed || decompressed_len != len || memcmp(decompressed, data, len) != 0;
+    
+    bench_free(compressed);
+    bench_free(decompressed);
+    bench_free(delta.data);
+    bench_free(rle.data);
+    bench_free(packed.data);
+    bench_free(unpacked.data);
+    bench_free(unrle.data);
+    bench_free(tables.data);
+    free(table);
+    return failed;
+}
+
+static int bench_path(const bench_t * b_template, const char * path, const uint8_t (*flag_sets)[3], size_t flag_set_count)
+{
+    FILE * f = fopen(path, "rb");
+    if (!f)
+    {
+        fprintf(stderr, "error: failed to open %s\n", path);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    size_t len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t * data = (uint8_t *)malloc(len ? len : 1);
+    if (fread(data, 1, len, f) != len)
+        len = 0;
+    fclose(f);
+    
+    int failed = 0;
+    for (size_t i = 0; i < flag_set_count; i++)
+    {
+        bench_t b = *b_template;
+        b.file = path;
+        memcpy(b.flags, flag_sets[i], 3);
+        if (bench_file(&b, data, len) != 0)
+        {
+            fprintf(stderr, "error: %s didn't round trip with flags r%dh%dd%d\n", path, b.flags[0], b.flags[1], b.flags[2]);
+            failed = -1;
+        }
+    }
+    free(data);
+    return failed;
+}
+
+// benchmarks a file, or every file directly inside a directory
+static int bench_arg(const bench_t * b, const char * path, const uint8_t (*flag_sets)[3], size_t flag_set_count)
+{
+    char full[4096];
+    int failed = 0;
+#if defined(_WIN32)
+    DWORD attributes = GetFileAttributesA(path);
+    if (attributes == INVALID_FILE_ATTRIBUTES || !(attributes & FILE_ATTRIBUTE_DIRECTORY))
+        return bench_path(b, path, flag_sets, flag_set_count);
+    snprintf(full, sizeof(full), "%s\\*", path);
+    WIN32_FIND_DATAA found;
+    HANDLE find = FindFirstFileA(full, &found);
+    if (find == INVALID_HANDLE_VALUE)
+        return 0;
+    do
+    {
+        if (found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            continue;
+        snprintf(full, sizeof(full), "%s\\%s", path, found.cFileName);
+        failed |= bench_path(b, full, flag_sets, flag_set_count);
+    } while (FindNextFileA(find, &found));
+    FindClose(find);
+#else
+    struct stat info;
+    if (stat(path, &info) != 0 || !S_ISDIR(info.st_mode))
+        return bench_path(b, path, flag_sets, flag_set_count);
+    DIR * dir = opendir(path);
+    if (!dir)
+        return -1;
+    struct dirent * entry;
+    while ((entry = readdir(dir)))
+    {
+        snprintf(full, sizeof(full), "%s/%s", path, entry->d_name);
+        if (stat(full, &info) != 0 || !S_ISREG(info.st_mode))
+            continue;
+        failed |= bench_path(b, full, flag_sets, flag_set_count);
+    }
+    closedir(dir);
+#endif
+    return failed;
+}
+
+int main(int argc, char ** argv)
+{
+    static const uint8_t default_flags[][3] = {{1, 2, 0}, {0, 2, 0}, {1, 0, 0}, {1, 3, 0}, {0, 2, 3}, {1, 2, 4}, {2, 2, 0}, {1, 5, 0}};
+    uint8_t flag_sets[64][3];
+    size_t flag_set_count = 0;
+    bench_t b = {0, {0, 0, 0}, 5};
+    const char * paths[256];
+    size_t path_count = 0;
+    
+    for (int i = 1; i < argc; i++)
+    {
+        if (argv[i][0] == '-' && argv[i][1] == 'n' && i + 1 < argc)
+            b.runs = strtol(argv[++i], 0, 10);
+        else if (argv[i][0] == '-' && argv[i][1] == 'f' && i + 1 < argc && flag_set_count < 64)
+        {
+            // r,h,d
+            char * end = argv[++i];
+            for (size_t k = 0; k < 3; k++)
+                flag_sets[flag_set_count][k] = strtol(*end == ',' ? end + 1 : end, &end, 10);
+            flag_set_count += 1;
+        }
+        else if (path_count < 256)
+            paths[path_count++] = argv[i];
+    }
+    
+    if (path_count == 0)
+    {
+        puts("usage: barph_bench <file or directory>... [-n runs] [-f rle,huff,diff]...");
+        puts("Times each stage on its own (delta, RLE or LZ77 and Huffman or tANS, both ways, and the checksum and hash), then the whole pipeline, for every file and set of flags.");
+        puts("Directories are read one level deep. Each stage is run 5 times by default, and the fastest run is reported.");
+        puts("-f: a set of flags to try, in the same order as barph's numeric arguments; can be given more than once. Without it, a spread of common flags is tried.");
+        puts("Output is tab-separated, one line per stage: file, flags, stage, input bytes, output bytes, ratio, MB/s on the uncompressed side, and peak heap bytes.");
+        puts("Exits with 1 if any file doesn't round trip.");
+        return 0;
+    }
+    if (flag_set_count == 0)
+    {
+        flag_set_count = sizeof(default_flags) / sizeof(default_flags[0]);
+        memcpy(flag_sets, default_flags, sizeof(default_flags));
+    }
+    if (b.runs == 0)
+        b.runs = 1;
+    
+    puts("file\tflags\tstage\tin_bytes\tout_bytes\tratio\tmb_per_s\tpeak_bytes");
+    int failed = 0;
+    for (size_t i = 0; i < path_count; i++)
+        failed |= bench_arg(&b, paths[i], (const uint8_t (*)[3])flag_sets, flag_set_count);
+    return failed ? 1 : 0;
+}
@@ -18,116 +18,290 @@
 #define BARPH_FREE free
 #endif
 
+// everything is static, so the header only has to be included; the public functions are also marked as possibly unused,
+// so that a program that doesn't call all of them still builds without warnings
+#if defined(__GNUC__)
+#define BARPH_API static __attribute__((unused))
+#else
+#define BARPH_API static
+#endif
+
+// define BARPH_NO_THREADS to build without pthreads; block containers are then compressed and decompressed serially
+#ifndef BARPH_NO_THREADS
+#include <pthread.h>
+#endif
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+// the file API and timing use POSIX functions, which strict C builds (like -std=c99) only declare when _POSIX_C_SOURCE is defined
+// before anything is included, as barph.c does
+#include <unistd.h>
+#include <time.h>
+// define BARPH_NO_MMAP to read and write whole files with stdio instead of mapping them
+#ifndef BARPH_NO_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// the delta filter has SSE2 and AVX2 kernels, used when the compiler targets them; everything else gets the scalar loops
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BARPH_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#define BARPH_AVX2
+#include <immintrin.h>
+#endif
+
 
 typedef struct {
     uint8_t * data;
     size_t len;
     size_t cap;
+    // set when data belongs to the caller, which is never reallocated; growing past cap moves the contents into memory of the buffer's own instead,
+    // which the caller can tell by data having changed
+    int borrowed;
 } byte_buffer_t;
 
-static void bytes_reserve(byte_buffer_t * buf, size_t extra)
+// makes room for extra more bytes; returns nonzero, leaving buf as it was, if the size overflows or the memory can't be had
+static int bytes_reserve(byte_buffer_t * buf, size_t extra)
 {
-    if (buf->cap < 8)
-        buf->cap = 8;
-    while (buf->len + extra > buf->cap)
-        buf->cap <<= 1;
-    buf->data = (uint8_t *)BARPH_REALLOC(buf->data, buf->cap);
+    if (buf->data && extra <= buf->cap - buf->len)
+        return 0;
+    if (extra > SIZE_MAX - buf->len)
+        return -1;
+    size_t need = buf->len + extra;
+    size_t cap = buf->cap < 8 ? 8 : buf->cap;
+    while (cap < need)
+        cap = cap > SIZE_MAX / 2 ? need : cap << 1;
+    uint8_t * data;
+    if (buf->borrowed)
+    {
+        data = (uint8_t *)BARPH_MALLOC(cap);
+        if (data)
+            memcpy(data, buf->data, buf->len);
+    }
+    else
+        data = (uint8_t *)BARPH_REALLOC(buf->data, cap);
+    if (!data)
+        return -1;
+    buf->data = data;
+    buf->cap = cap;
+    buf->borrowed = 0;
+    return 0;
 }
-static void bytes_push(byte_buffer_t * buf, const uint8_t * bytes, size_t count)
+// the push functions return nonzero if they couldn't make room, and then leave the buffer as it was
+static int bytes_push(byte_buffer_t * buf, const uint8_t * bytes, size_t count)
 {
-    bytes_reserve(buf, count);
+    if (bytes_reserve(buf, count) != 0)
+        return -1;
     memcpy(&buf->data[buf->len], bytes, count);
     buf->len += count;
+    return 0;
 }
-static void byte_push_many(byte_buffer_t * buf, uint8_t byte, size_t count)
+static int byte_push(byte_buffer_t * buf, uint8_t byte)
 {
-    bytes_reserve(buf, count);
-    memset(&buf->data[buf->len], byte, count);
-    buf->len += count;
+    if (buf->len == buf->cap && bytes_reserve(buf, 1) != 0)
+        return -1;
+    buf->data[buf->len] = byte;
+    buf->len += 1;
+    return 0;
+}
+
+static uint64_t load_u64le(const uint8_t * data)
+{
+    uint64_t ret;
+    memcpy(&ret, data, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    ret = __builtin_bswap64(ret);
+#endif
+    return ret;
+}
+static void store_u64le(uint8_t * data, uint64_t n)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    n = __builtin_bswap64(n);
+#endif
+    memcpy(data, &n, 8);
+}
+static uint32_t load_u32le(const uint8_t * data)
+{
+    return data[0] | (((uint32_t)data[1]) << 8) | (((uint32_t)data[2]) << 16) | (((uint32_t)data[3]) << 24);
+}
+static void store_u32le(uint8_t * data, uint32_t n)
+{
+    data[0] = (uint8_t)n;
+    data[1] = (uint8_t)(n >> 8);
+    data[2] = (uint8_t)(n >> 16);
+    data[3] = (uint8_t)(n >> 24);
+}
+static int bytes_push_u32(byte_buffer_t * buf, uint32_t n)
+{
+    uint8_t bytes[4] = {(uint8_t)n, (uint8_t)(n >> 8), (uint8_t)(n >> 16), (uint8_t)(n >> 24)};
+    return bytes_push(buf, bytes, 4);
+}
+static int bytes_push_u64(byte_buffer_t * buf, uint64_t n)
+{
+    uint8_t bytes[8];
+    store_u64le(bytes, n);
+    return bytes_push(buf, bytes, 8);
 }
-static void byte_push(byte_buffer_t * buf, uint8_t byte)
+// LEB128: seven bits per byte, lowest first, with the top bit set on every byte but the last
+static int bytes_push_varint(byte_buffer_t * buf, uint64_t n)
 {
-    if (buf->len == buf->cap)
+    uint8_t bytes[10];
+    size_t count = 0;
+    while (n >= 0x80)
     {
-        buf->cap = buf->cap << 1;
-        if (buf->cap < 8)
-            buf->cap = 8;
-        buf->data = (uint8_t *)BARPH_REALLOC(buf->data, buf->cap);
+        bytes[count++] = (uint8_t)(n | 0x80);
+        n >>= 7;
     }
-    buf->data[buf->len] = byte;
-    buf->len += 1;
+    bytes[count++] = (uint8_t)n;
+    return bytes_push(buf, bytes, count);
+}
+// reads a varint at *pos, moving *pos past it; returns nonzero if it runs past the end or is too long
+static int load_varint(const uint8_t * data, size_t len, size_t * pos, uint64_t * n)
+{
+    *n = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7)
+    {
+        if (*pos >= len)
+            return -1;
+        uint8_t byte = data[(*pos)++];
+        *n |= ((uint64_t)(byte & 0x7F)) << shift;
+        if (!(byte & 0x80))
+            return 0;
+    }
+    return -1;
 }
 
+// bits are packed lowest bit first, through a 64-bit accumulator that's written out a whole number of bytes at a time
 typedef struct {
     byte_buffer_t buffer;
-    size_t byte_index;
-    size_t bit_count;
-    uint8_t bit_index;
-} bit_buffer_t;
+    uint64_t acc;
+    uint8_t acc_bits;
+} bit_writer_t;
 
-static void bits_push(bit_buffer_t * buf, uint64_t data, uint8_t bits)
+// makes room for the given number of bits; bits_write doesn't check for space on its own, so nothing can be written if this returns nonzero
+static int bits_reserve(bit_writer_t * w, size_t bits)
 {
-    if (bits == 0)
-        return;
-    for (uint8_t n = 0; n < bits; n += 1)
-    {
-        if (buf->bit_index >= 8 || buf->buffer.len == 0)
-        {
-            byte_push(&buf->buffer, 0);
-            if (buf->bit_index >= 8)
-            {
-                buf->bit_index -= 8;
-                buf->byte_index += 1;
-            }
-        }
-        buf->buffer.data[buf->buffer.len - 1] |= (!!(data & ((uint64_t)1 << n))) << buf->bit_index;
-        buf->bit_index += 1;
-        buf->bit_count += 1;
-    }
+    // bits_write always stores a full 8 bytes
+    return bytes_reserve(&w->buffer, (bits + 7) / 8 + 8);
 }
-static void bit_push(bit_buffer_t * buf, uint8_t data)
+// writes the lowest `count` bits of `data`, which must not have any higher bits set; `count` can be at most 56
+static void bits_write(bit_writer_t * w, uint64_t data, uint8_t count)
 {
-    if (buf->bit_index >= 8 || buf->buffer.len == 0)
-    {
-        byte_push(&buf->buffer, 0);
-        if (buf->bit_index >= 8)
-        {
-            buf->bit_index -= 8;
-            buf->byte_index += 1;
-        }
-    }
-    buf->buffer.data[buf->buffer.len - 1] |= data << buf->bit_index;
-    buf->bit_index += 1;
-    buf->bit_count += 1;
+    w->acc |= data << w->acc_bits;
+    w->acc_bits += count;
+    store_u64le(&w->buffer.data[w->buffer.len], w->acc);
+    w->buffer.len += w->acc_bits >> 3;
+    w->acc >>= w->acc_bits & ~7;
+    w->acc_bits &= 7;
 }
-static uint64_t bits_pop(bit_buffer_t * buf, uint8_t bits)
+// writes out the last partial byte, if any
+static void bits_flush(bit_writer_t * w)
 {
-    if (bits == 0)
-        return 0;
-    uint64_t ret = 0;
-    for (uint8_t n = 0; n < bits; n += 1)
+    if (w->acc_bits)
+        w->buffer.len += 1;
+    w->acc = 0;
+    w->acc_bits = 0;
+}
+
+typedef struct {
+    const uint8_t * data;
+    size_t len;
+    // next byte to be loaded into the accumulator
+    size_t pos;
+    uint64_t acc;
+    uint8_t acc_bits;
+} bit_reader_t;
+
+// tops the accumulator up to at least 56 bits; past the end of the data, zeros are read
+static inline void bits_refill(bit_reader_t * r)
+{
+    if (r->pos + 8 <= r->len)
+    {
+        r->acc |= load_u64le(&r->data[r->pos]) << r->acc_bits;
+        r->pos += (63 - r->acc_bits) >> 3;
+        r->acc_bits |= 56;
+    }
+    else
     {
-        if (buf->bit_index >= 8)
+        while (r->acc_bits <= 56)
         {
-            buf->bit_index -= 8;
-            buf->byte_index += 1;
+            if (r->pos < r->len)
+                r->acc |= ((uint64_t)r->data[r->pos]) << r->acc_bits;
+            r->pos += 1;
+            r->acc_bits += 8;
         }
-        ret |= (uint64_t)((buf->buffer.data[buf->byte_index] >> buf->bit_index) & 1) << n;
-        buf->bit_index += 1;
     }
+}
+static void bits_consume(bit_reader_t * r, uint8_t count)
+{
+    r->acc >>= count;
+    r->acc_bits -= count;
+}
+// reads `count` bits, at most 56
+static uint64_t bits_read(bit_reader_t * r, uint8_t count)
+{
+    if (r->acc_bits < count)
+        bits_refill(r);
+    uint64_t ret = r->acc & ((((uint64_t)1) << count) - 1);
+    bits_consume(r, count);
     return ret;
 }
-static uint8_t bit_pop(bit_buffer_t * buf)
+
+static unsigned barph_ctz64(uint64_t n)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, n);
+    return index;
+#else
+    return __builtin_ctzll(n);
+#endif
+}
+// the index of the highest set bit; n must be nonzero
+static unsigned barph_top_bit64(uint64_t n)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse64(&index, n);
+    return index;
+#else
+    return 63 - __builtin_clzll(n);
+#endif
+}
+// log2(n) in 256ths of a bit, to within about a hundredth of a bit; n must be nonzero
+static uint32_t barph_log2_fixed(uint64_t n)
+{
+    unsigned top = barph_top_bit64(n);
+    // the eight bits after the top one give the fractional part, with a quadratic correction: log2(1 + f) ~= f + 0.34 * f * (1 - f)
+    uint32_t frac = (uint32_t)(top >= 8 ? n >> (top - 8) : n << (8 - top)) & 0xFF;
+    return (uint32_t)top * 256 + frac + ((frac * (256 - frac) * 87) >> 16);
+}
+
+// number of leading bytes that are the same in a and b, up to max, compared 8 at a time
+static size_t rle_match_len(const uint8_t * a, const uint8_t * b, size_t max)
 {
-    if (buf->bit_index >= 8)
+    size_t n = 0;
+    while (n + 8 <= max)
     {
-        buf->bit_index -= 8;
-        buf->byte_index += 1;
+        uint64_t x = load_u64le(&a[n]) ^ load_u64le(&b[n]);
+        if (x)
+            return n + (barph_ctz64(x) >> 3);
+        n += 8;
     }
-    uint8_t ret = (buf->buffer.data[buf->byte_index] >> buf->bit_index) & 1;
-    buf->bit_index += 1;
-    
-    return ret;
+    while (n < max && a[n] == b[n])
+        n += 1;
+    return n;
 }
 
 static int has_efficient_rle(const uint8_t * input, size_t input_len)
@@ -157,18 +331,50 @@ static int has_efficient_rle(const uint8_t * input, size_t input_len)
     return 0;
 }
 
-static byte_buffer_t super_big_rle_compress(const uint8_t * input, size_t input_len)
+// has 0x80 in every byte of n that's zero, and 0x00 in every other byte
+static uint64_t zero_bytes(uint64_t n)
 {
-    byte_buffer_t ret = {0, 0, 0};
-    
-    byte_push(&ret, input_len & 0xFF);
-    byte_push(&ret, (input_len >> 8) & 0xFF);
-    byte_push(&ret, (input_len >> 16) & 0xFF);
-    byte_push(&ret, (input_len >> 24) & 0xFF);
-    byte_push(&ret, (input_len >> 32) & 0xFF);
-    byte_push(&ret, (input_len >> 40) & 0xFF);
-    byte_push(&ret, (input_len >> 48) & 0xFF);
-    byte_push(&ret, (input_len >> 56) & 0xFF);
+    const uint64_t low_bits = 0x7F7F7F7F7F7F7F7FULL;
+    return ~(((n & low_bits) + low_bits) | n | low_bits);
+}
+
+// finds the first position from `start` up to `end` where has_efficient_rle would succeed, or returns `end`
+// four positions are checked at once, from byte equality masks at distances 1 to 4
+static size_t find_efficient_rle(const uint8_t * input, size_t input_len, size_t start, size_t end)
+{
+    size_t p = start;
+    for (; p < end && p + 12 <= input_len; p += 4)
+    {
+        uint64_t w = load_u64le(&input[p]);
+        uint64_t eq_1 = zero_bytes(w ^ load_u64le(&input[p + 1]));
+        uint64_t eq_2 = zero_bytes(w ^ load_u64le(&input[p + 2]));
+        uint64_t eq_3 = zero_bytes(w ^ load_u64le(&input[p + 3]));
+        uint64_t eq_4 = zero_bytes(w ^ load_u64le(&input[p + 4]));
+        uint64_t found = (eq_1 & (eq_1 >> 8))
+            | (eq_2 & (eq_2 >> 8))
+            | (eq_3 & (eq_3 >> 8) & (eq_3 >> 16))
+            | (eq_4 & (eq_4 >> 8) & (eq_4 >> 16) & (eq_4 >> 24));
+        found &= 0x80808080;
+        if (found)
+        {
+            p += barph_ctz64(found) >> 3;
+            return p < end ? p : end;
+        }
+    }
+    for (; p < end; p += 1)
+    {
+        if (has_efficient_rle(&input[p], input_len - p))
+            return p;
+    }
+    return end;
+}
+
+// appends to out; returns nonzero if it runs out of memory, with out's length left wherever it got to
+static int super_big_rle_compress(byte_buffer_t * out, const uint8_t * input, size_t input_len)
+{
+    byte_buffer_t ret = *out;
+    // once a push fails, the rest are still tried, but the output is thrown away
+    int failed = bytes_push_u64(&ret, input_len);
     
     size_t i = 0;
     
@@ -177,487 +383,4349 @@ static byte_buffer_t super_big_rle_compress(const uint8_t * input, size_t input_
         size_t j = i;
         size_t rle_size = 0;
         
+        // only word sizes whose second word starts with the same byte as the first can have a run
+        // (sizes without a run at all can't ever beat sizes with one, so they're skipped)
+        uint32_t candidates = 0;
+        if (i + 17 <= input_len)
+        {
+            uint64_t first = input[i] * 0x0101010101010101ULL;
+            uint64_t lo = zero_bytes(load_u64le(&input[i + 1]) ^ first) >> 7;
+            uint64_t hi = zero_bytes(load_u64le(&input[i + 9]) ^ first) >> 7;
+            // gather one bit from each byte
+            candidates = (uint32_t)(((lo * 0x0102040810204080ULL) >> 56) | (((hi * 0x0102040810204080ULL) >> 56) << 8)) << 1;
+        }
+        else
+        {
+            for (size_t size = 1; size < 16 && i + size < input_len; ++size)
+                candidates |= (uint32_t)(input[i + size] == input[i]) << size;
+        }
+        candidates &= 0xFFFE;
+        
         // try out various word sizes from 1 to 16
-        for (size_t _size = 1; _size < 16; ++_size)
+        while (candidates)
         {
-            size_t size = _size;
-            
-            if (i + size > input_len)
-                break;
+            size_t size = barph_ctz64(candidates);
+            candidates &= candidates - 1;
             
-            // loop forward until we hit a differing byte pair
-            size_t count = _size == 1 ? 127 : 63;
+            // a run of words of this size is as long as the input matches itself shifted over by one word, rounded down to whole words
+            size_t count = size == 1 ? 127 : 63;
+            size_t limit = (i + count * size) < input_len ? (i + count * size) : input_len;
             size_t j2 = i + size;
-            while (j2 + size <= ((i + count * size) < input_len ? (i + count * size) : input_len))
-            {
-                for (size_t off = 0; off < size; off += 1)
-                {
-                    uint8_t c = input[j2 + off - size];
-                    uint8_t b = input[j2 + off];
-                    if (c != b)
-                        goto outer;
-                }
-                j2 += size;
-            }
-outer:
+            if (j2 + size > limit)
+                continue;
+            size_t match = rle_match_len(&input[i], &input[i + size], limit - j2);
+            if (match < size)
+                continue;
+            j2 += match / size * size;
+            
+            // check if this run is more efficient than the best run
+            size_t old_src = j - i;
+            size_t new_src = j2 - i;
+            size_t new_dest = (size + (size < 2 ? size : 2));
+            size_t old_dest = ((rle_size > 1 ? rle_size : 1) + (rle_size < 2 ? rle_size : 2));
+            // multiplying by opposite term is, without the int division truncation, equivalent to dividing by the correct term and then multiplying both by both terms
+            size_t old_eff = old_src * new_dest;
+            size_t new_eff = new_src * old_dest;
+            if (new_eff > old_eff)
             {
-                // check if this run is more efficient than the best run
-                size_t old_src = j - i;
-                size_t new_src = j2 - i;
-                size_t new_dest = (size + (size < 2 ? size : 2));
-                size_t old_dest = ((rle_size > 1 ? rle_size : 1) + (rle_size < 2 ? rle_size : 2));
-                // multiplying by opposite term is, without the int division truncation, equivalent to dividing by the correct term and then multiplying both by both terms
-                size_t old_eff = old_src * new_dest;
-                size_t new_eff = new_src * old_dest;
-                if (new_eff > old_eff)
-                {
-                    rle_size = size;
-                    j = j2;
-                }
+                rle_size = size;
+                j = j2;
             }
         }
-        uint8_t n = (j - i) / rle_size - 1;
+        uint8_t n = rle_size ? (j - i) / rle_size - 1 : 0;
         // if we didn't find any RLE, store a literal
+        // it runs up to one byte before the next place where RLE would be worth it, but is at least 16 bytes long
         if (n == 0)
         {
-            uint16_t size;
-            for (size = 17; size < (1 << 14); size += 1)
+            size_t size = (1 << 14) - 1;
+            size_t end = i + (1 << 14) < input_len ? i + (1 << 14) : input_len;
+            if (i + 17 < end)
             {
-                if (i + size > input_len)
-                    break;
-                if (has_efficient_rle(&input[i + size], input_len - (i + size)))
-                    break;
+                size_t next = find_efficient_rle(input, input_len, i + 17, end);
+                if (next < end)
+                    size = next - i - 1;
             }
-            size -= 1;
             if (size > input_len - i)
                 size = input_len - i;
             
-            byte_push(&ret, 0xC0 | (size & 0x3F));
-            byte_push(&ret, size >> 6);
-            for (size_t j = 0; j < size; ++j)
-                byte_push(&ret, input[i++]);
+            failed |= byte_push(&ret, 0xC0 | (size & 0x3F));
+            failed |= byte_push(&ret, size >> 6);
+            failed |= bytes_push(&ret, &input[i], size);
+            i += size;
             continue;
         }
         // if we found RLE, store the RLE
         if (rle_size > 1)
         {
-            byte_push(&ret, n | 0x80);
-            byte_push(&ret, rle_size - 2);
+            failed |= byte_push(&ret, n | 0x80);
+            failed |= byte_push(&ret, rle_size - 2);
         }
         else
-            byte_push(&ret, n);
-        for (size_t off = 0; off < rle_size; ++off)
-            byte_push(&ret, input[i + off]);
+            failed |= byte_push(&ret, n);
+        failed |= bytes_push(&ret, &input[i], rle_size);
         i = j;
     }
     
-    return ret;
+    *out = ret;
+    return failed;
 }
 
-static byte_buffer_t super_big_rle_decompress(const uint8_t * input, size_t input_len)
+// when both buffers have this many bytes to spare, short tokens are copied with fixed-size stores that can run past their ends,
+// which later tokens overwrite, instead of with calls sized to the token
+#define BARPH_RLE_SLACK 32
+
+// expands the whole tokens at the start of input into out, from *pos up to out_len, and sets *used to how many bytes of input they took;
+// a token cut off by the end of input is left for the next call, so input can come in pieces. returns nonzero if the tokens don't fit in out
+static int rle_expand(uint8_t * out, size_t out_len, size_t * pos, const uint8_t * input, size_t input_len, size_t * used)
 {
     size_t i = 0;
+    size_t o = *pos;
+    int failed = 0;
     
-    uint64_t size = 0;
-    size |= input[i++];
-    size |= ((uint64_t)input[i++]) << 8;
-    size |= ((uint64_t)input[i++]) << 16;
-    size |= ((uint64_t)input[i++]) << 24;
-    size |= ((uint64_t)input[i++]) << 32;
-    size |= ((uint64_t)input[i++]) << 40;
-    size |= ((uint64_t)input[i++]) << 48;
-    size |= ((uint64_t)input[i++]) << 56;
-    
-    byte_buffer_t ret = {0, 0, 0};
-    
-    bytes_reserve(&ret, size);
-    
-    while (i < input_len)
+    // every token has at least two bytes
+    while (i + 2 <= input_len)
     {
-        uint8_t dat = input[i++];
+        uint8_t dat = input[i];
+        uint8_t arg = input[i + 1];
+        
+        // each token's sizes are checked once, up front, so the copies themselves don't need to check anything
+        size_t in_size;
+        size_t out_size;
         // literal
         // in RLE mode, bits 7 and 6 cannot be set at the same time, so this works as a signal
         if ((dat & 0xC0) == 0xC0)
         {
-            uint16_t size = 0;
-            size |= dat & 0x3F;
-            size |= ((uint16_t)input[i++]) << 6;
-            
-            bytes_push(&ret, &input[i], size);
-            i += size;
+            out_size = (dat & 0x3F) | ((size_t)arg << 6);
+            in_size = out_size + 2;
+        }
+        // single-byte word mode (n can be up to 128)
+        else if (!(dat & 0x80))
+        {
+            out_size = (size_t)dat + 1;
+            in_size = 2;
         }
-        // RLE
+        // long word mode (n can be up to 64, and the word up to 257 bytes)
         else
         {
-            // number of extra repetitions is stored in the lower 7 bits of dat
-            size_t n = (dat & 0x7F) + 1;
-            
-            // single-byte word mode (n can be up to 127)
-            if (!(dat & 0x80))
+            out_size = (size_t)((dat & 0x3F) + 1) * ((size_t)arg + 2);
+            in_size = (size_t)arg + 4;
+        }
+        if (in_size > input_len - i)
+            break;
+        if (out_size > out_len - o)
+        {
+            failed = -1;
+            break;
+        }
+        int out_slack = out_len - o >= BARPH_RLE_SLACK;
+        
+        if ((dat & 0xC0) == 0xC0)
+        {
+            if (out_size <= BARPH_RLE_SLACK && out_slack && input_len - i - 2 >= BARPH_RLE_SLACK)
+                memcpy(&out[o], &input[i + 2], BARPH_RLE_SLACK);
+            else
+                memcpy(&out[o], &input[i + 2], out_size);
+        }
+        else if (!(dat & 0x80))
+        {
+            if (out_size <= BARPH_RLE_SLACK && out_slack)
+                memset(&out[o], arg, BARPH_RLE_SLACK);
+            else
+                memset(&out[o], arg, out_size);
+        }
+        else
+        {
+            size_t word = (size_t)arg + 2;
+            size_t n = (dat & 0x3F) + 1;
+            // a few short words are stored one at a time, 16 bytes each
+            if (word <= 16 && n <= 8 && out_len - o - out_size >= 16 && input_len - i - 2 >= 16)
             {
-                uint8_t c = input[i++];
-                byte_push_many(&ret, c, n);
+                for (size_t j = 0; j < n; j += 1)
+                    memcpy(&out[o + j * word], &input[i + 2], 16);
             }
-            // long word mode (note: n will be at most 63)
+            // otherwise the first word is copied, and then what's been written so far is copied after itself, doubling it each time
             else
             {
-                size_t rle_size = input[i++] + 2;
-                bytes_push(&ret, &input[i], rle_size);
-                i += rle_size;
-                
-                for (size_t j = 0; j < (n - 1); j += 1)
-                    bytes_push(&ret, &ret.data[ret.len - rle_size], rle_size);
+                memcpy(&out[o], &input[i + 2], word);
+                for (size_t done = word; done < out_size; )
+                {
+                    size_t count = done < out_size - done ? done : out_size - done;
+                    memcpy(&out[o + done], &out[o], count);
+                    done += count;
+                }
             }
         }
+        o += out_size;
+        i += in_size;
     }
     
-    return ret;
+    *pos = o;
+    *used = i;
+    return failed;
 }
 
-typedef struct _huff_node {
-    struct _huff_node * children[2];
-    int64_t freq;
-    bit_buffer_t code;
-    uint8_t symbol;
-} huff_node_t;
-
-static huff_node_t * alloc_huff_node()
+// the length that RLE data expands to, which comes first; returns nonzero if it's missing, or more than the tokens could make
+static int rle_expanded_size(const uint8_t * input, size_t input_len, uint64_t * size)
 {
-    return (huff_node_t *)BARPH_MALLOC(sizeof(huff_node_t));
+    if (input_len < 8)
+        return -1;
+    *size = load_u64le(input);
+    // no token expands more than 64 times over
+    return *size / 64 > input_len - 8 ? -1 : 0;
 }
 
-static void free_huff_nodes(huff_node_t * node)
-{
-    if (node->children[0])
-        free_huff_nodes(node->children[0]);
-    if (node->children[1])
-        free_huff_nodes(node->children[1]);
-    BARPH_FREE(node);
-}
+// LZ77, for do_rle 2: instead of runs of words, the RLE stage stores copies of any earlier data within a window, found through hash chains
+// the output starts with its expanded length, like RLE's, and then has tokens of literals followed by a match. each token starts with a byte
+// with the number of literals in its top four bits and the match length minus 3 in its bottom four (0 for no match); a count of 15 continues
+// in bytes that are added to it, up to one that isn't 255. the literal count's bytes come right after the first byte, then the literals,
+// then, for a match, how far back it starts as a varint, and the rest of its length
+#define BARPH_RLE_LZ 2
+#define BARPH_RLE_MAX_MODE 2
 
-static void push_code(huff_node_t * node, uint8_t bit)
-{
-    bit_push(&node->code, bit);
-    if (node->children[0])
-        push_code(node->children[0], bit);
-    if (node->children[1])
-        push_code(node->children[1], bit);
-}
+// how far back matches can reach, unless barph_ctx_t's lz_window says otherwise; windows are rounded down to a power of two, up to BARPH_LZ_MAX_WINDOW
+// the decoder doesn't need to know it, since it can copy from anywhere in what it's already written
+#ifndef BARPH_LZ_WINDOW
+#define BARPH_LZ_WINDOW (1 << 16)
+#endif
+#define BARPH_LZ_MAX_WINDOW (1 << 24)
 
-static int count_compare(const void * a, const void * b)
+// how many earlier positions with the same hash are tried for each match; more finds longer matches, but compresses slower
+#ifndef BARPH_LZ_CHAIN
+#define BARPH_LZ_CHAIN 16
+#endif
+
+#define BARPH_LZ_HASH_BITS 16
+#define BARPH_LZ_MIN_MATCH 4
+// tokens are kept short enough that the longest one fits in the fused decoder's window
+#define BARPH_LZ_MAX_LITERALS ((1 << 14) - 1)
+#define BARPH_LZ_MAX_MATCH ((1 << 14) - 1)
+
+static uint32_t lz_hash(const uint8_t * data, unsigned bits)
 {
-    int64_t n = *((int64_t*)b) - *((int64_t*)a);
-    return n > 0 ? 1 : n < 0 ? -1 : 0;
+    return (load_u32le(data) * 2654435761u) >> (32 - bits);
 }
 
-static void push_huff_node(bit_buffer_t * buf, huff_node_t * node)
+// the part of a length that didn't fit in its token
+static int lz_push_length(byte_buffer_t * out, size_t n)
 {
-    if (node->children[0] && node->children[1])
-    {
-        bit_push(buf, 1);
-        push_huff_node(buf, node->children[0]);
-        push_huff_node(buf, node->children[1]);
-    }
-    else
-    {
-        bit_push(buf, 0);
-        bits_push(buf, node->symbol, 8);
-    }
+    int failed = 0;
+    for (; n >= 255; n -= 255)
+        failed |= byte_push(out, 255);
+    return failed | byte_push(out, (uint8_t)n);
 }
 
-static huff_node_t * pop_huff_node(bit_buffer_t * buf)
+// appends tokens for some literals followed by a match, or just the literals if match is 0; returns nonzero if it runs out of memory
+static int lz_push_tokens(byte_buffer_t * out, const uint8_t * literals, size_t literal_len, size_t offset, size_t match)
 {
-    huff_node_t * ret;
-    ret = alloc_huff_node();
-    ret->symbol = 0;
-    memset(&ret->code, 0, sizeof(bit_buffer_t));
-    ret->freq = 0;
-    ret->children[0] = 0;
-    ret->children[1] = 0;
-    
-    int children = bit_pop(buf);
-    if (children)
+    int failed = 0;
+    do
     {
-        ret->children[0] = pop_huff_node(buf);
-        ret->children[1] = pop_huff_node(buf);
-        push_code(ret->children[0], 0);
-        push_code(ret->children[1], 1);
-    }
-    else
-    {
-        ret->symbol = bits_pop(buf, 8);
-    }
-    
-    return ret;
+        size_t n = literal_len < BARPH_LZ_MAX_LITERALS ? literal_len : BARPH_LZ_MAX_LITERALS;
+        // only the last token of a long run of literals gets the match
+        size_t m = n == literal_len ? match : 0;
+        size_t m_code = m ? (m - 3 < 15 ? m - 3 : 15) : 0;
+        failed |= byte_push(out, (uint8_t)(((n < 15 ? n : 15) << 4) | m_code));
+        if (n >= 15)
+            failed |= lz_push_length(out, n - 15);
+        failed |= bytes_push(out, literals, n);
+        if (m)
+        {
+            failed |= bytes_push_varint(out, offset);
+            if (m_code == 15)
+                failed |= lz_push_length(out, m - 18);
+        }
+        literals += n;
+        literal_len -= n;
+    } while (literal_len > 0);
+    return failed;
 }
 
-static bit_buffer_t huff_pack(uint8_t * data, size_t len)
+// appends to out; tables holds the hash chains, and is reused between calls
+// every position goes into the chains, and each one takes the longest match of the first BARPH_LZ_CHAIN that share its hash
+// positions are kept as 32 bits, so on huge inputs an old one can come back around as a recent one, but every match is checked against the data anyway
+// returns nonzero if it runs out of memory
+static int lz_compress(byte_buffer_t * out, byte_buffer_t * tables, const uint8_t * input, size_t input_len, size_t window)
 {
-    // build huff dictionary
-    
-    // count bytes, then sort them
-    // we stuff the byte identity into the bottom 8 bits
-    uint64_t counts[256] = {0};
-    for (size_t i = 0; i < len; i += 1)
-        counts[data[i]] += 256;
-    for (size_t b = 0; b < 256; b++)
-        counts[b] |= b;
-    qsort(&counts, 256, sizeof(uint64_t), count_compare);
-    
-    // set up raw huff nodes
-    huff_node_t * unordered_dict[256];
-    for (size_t i = 0; i < 256; i += 1)
-    {
-        unordered_dict[i] = alloc_huff_node();
-        unordered_dict[i]->symbol = counts[i] & 0xFF;
-        memset(&unordered_dict[i]->code, 0, sizeof(bit_buffer_t));
-        unordered_dict[i]->freq = counts[i] >> 8;
-        unordered_dict[i]->children[0] = 0;
-        unordered_dict[i]->children[1] = 0;
-    }
-    
-    // set up byte name -> huff node dict
-    huff_node_t * dict[256];
-    for (size_t i = 0; i < 256; i += 1)
-        dict[unordered_dict[i]->symbol] = unordered_dict[i];
+    if (bytes_push_u64(out, input_len) != 0)
+        return -1;
     
-    // set up tree generation queues
-    huff_node_t * queue_in[256];
-    size_t queue_in_count = 256;
+    if (window == 0 || window > BARPH_LZ_MAX_WINDOW)
+        window = window ? BARPH_LZ_MAX_WINDOW : BARPH_LZ_WINDOW;
+    // the tables don't need to be any bigger than the input
+    size_t chain_len = 1;
+    while (chain_len * 2 <= window && chain_len < input_len)
+        chain_len *= 2;
+    unsigned bits = 8;
+    while (bits < BARPH_LZ_HASH_BITS && ((size_t)1 << bits) < input_len)
+        bits += 1;
+    tables->len = 0;
+    if (bytes_reserve(tables, (((size_t)1 << bits) + chain_len) * sizeof(uint32_t)) != 0)
+        return -1;
+    // a head of 0 means no positions have that hash yet, so positions are stored plus one
+    uint32_t * head = (uint32_t *)tables->data;
+    uint32_t * chain = &head[(size_t)1 << bits];
+    memset(head, 0, ((size_t)1 << bits) * sizeof(uint32_t));
     
-    huff_node_t * queue_out[256];
-    size_t queue_out_count = 0;
-    
-    for (size_t i = 0; i < 256; i += 1)
-        queue_in[i] = unordered_dict[i];
-    for (size_t i = 0; i < 256; i += 1)
-        queue_out[i] = 0;
-    
-    // remove zero-frequency items from the input queue
-    while (queue_in[queue_in_count - 1]->freq == 0 && queue_in_count > 0)
-    {
-        free_huff_nodes(queue_in[queue_in_count - 1]);
-        queue_in_count -= 1;
-    }
-    
-    // start pumping through the queues
-    while (queue_in_count + queue_out_count > 1)
+    size_t anchor = 0;
+    size_t i = 0;
+    // matches have to start at least BARPH_LZ_MIN_MATCH bytes from the end, to be hashed
+    size_t last = input_len >= BARPH_LZ_MIN_MATCH ? input_len - BARPH_LZ_MIN_MATCH + 1 : 0;
+    while (i < last)
     {
-        if (queue_out_count > 250)
+        uint32_t h = lz_hash(&input[i], bits);
+        size_t max = input_len - i < BARPH_LZ_MAX_MATCH ? input_len - i : BARPH_LZ_MAX_MATCH;
+        size_t best = 0;
+        size_t best_offset = 0;
+        uint32_t candidate = head[h];
+        for (size_t steps = BARPH_LZ_CHAIN; candidate && steps > 0; steps--)
         {
-            fprintf(stderr, "Huffman tree generation failed; vastly exceeded maximum tree depth.");
-            exit(-1);
+            // a position's link is overwritten once the chain wraps around past it
+            size_t offset = (uint32_t)((uint32_t)i + 1 - candidate);
+            if (offset == 0 || offset >= chain_len)
+                break;
+            const uint8_t * match = &input[i - offset];
+            // a longer match has to get past the end of the best one so far
+            if (match[best] == input[i + best])
+            {
+                size_t n = rle_match_len(match, &input[i], max);
+                if (n > best)
+                {
+                    best = n;
+                    best_offset = offset;
+                    if (n == max)
+                        break;
+                }
+            }
+            candidate = chain[(i - offset) & (chain_len - 1)];
         }
+        chain[i & (chain_len - 1)] = head[h];
+        head[h] = (uint32_t)i + 1;
         
-        // find lowest-frequency items
-        huff_node_t * nodes[4] = {0, 0, 0, 0};
-        nodes[0] = (queue_in_count  >= 1) ? (queue_in [queue_in_count  - 1]) : 0;
-        nodes[1] = (queue_in_count  >= 2) ? (queue_in [queue_in_count  - 2]) : 0;
-        nodes[2] = (queue_out_count >= 1) ? (queue_out[queue_out_count - 1]) : 0;
-        nodes[3] = (queue_out_count >= 2) ? (queue_out[queue_out_count - 2]) : 0;
-        
-        huff_node_t * lowest = 0;
-        for (size_t i = 0; i < 4; i++)
-            if (!lowest || (nodes[i] && nodes[i]->freq < lowest->freq))
-                lowest = nodes[i];
-        
-        huff_node_t * next_lowest = 0;
-        for (size_t i = 0; i < 4; i++)
-            if (nodes[i] != lowest && (!next_lowest || (nodes[i] && nodes[i]->freq < next_lowest->freq)))
-                next_lowest = nodes[i];
-        
-        // shrink queues depending on which nodes were gotten from which queue
-        queue_in_count  -=  (lowest == nodes[0] || lowest == nodes[1]) +  (next_lowest == nodes[0] || next_lowest == nodes[1]);
-        queue_out_count -= !(lowest == nodes[0] || lowest == nodes[1]) + !(next_lowest == nodes[0] || next_lowest == nodes[1]);
-        
-        // make new node
-        huff_node_t * new_node = alloc_huff_node();
-        new_node->symbol = 0;
-        memset(&new_node->code, 0, sizeof(bit_buffer_t));
-        new_node->freq = lowest->freq + next_lowest->freq;
-        new_node->children[0] = lowest;
-        new_node->children[1] = next_lowest;
-        
-        push_code(new_node->children[0], 0);
-        push_code(new_node->children[1], 1);
+        if (best < BARPH_LZ_MIN_MATCH)
+        {
+            i += 1;
+            continue;
+        }
+        if (lz_push_tokens(out, &input[anchor], i - anchor, best_offset, best) != 0)
+            return -1;
         
-        // insert new out-queue element at bottom
-        queue_out_count += 1;
-        for (size_t i = queue_out_count; i > 0; i -= 1)
-            queue_out[i] = queue_out[i-1];
-        queue_out[0] = new_node;
-    }
-    
-    // set up buffers and start pushing data to them
-    
-    bit_buffer_t ret;
-    memset(&ret, 0, sizeof(bit_buffer_t));
-    
-    bits_push(&ret, len, 8*8);
-    
-    push_huff_node(&ret, queue_out[0]);
-    
-    for(size_t i = 0; i < len; i++)
-    {
-        uint8_t c = data[i];
-        for (size_t n = 0; n < dict[c]->code.bit_count; n++)
+        // the positions inside the match go into the chains too, but aren't searched from
+        size_t end = i + best;
+        for (i += 1; i < end && i < last; i++)
         {
-            size_t m = dict[c]->code.bit_count - n - 1;
-            int bit = (dict[c]->code.buffer.data[m / 8] >> ((m % 8))) & 1;
-            bit_push(&ret, bit);
+            h = lz_hash(&input[i], bits);
+            chain[i & (chain_len - 1)] = head[h];
+            head[h] = (uint32_t)i + 1;
         }
+        i = end;
+        anchor = end;
     }
-    
-    free_huff_nodes(queue_out[0]);
-    
-    return ret;
+    if (anchor < input_len)
+        return lz_push_tokens(out, &input[anchor], input_len - anchor, 0, 0);
+    return 0;
 }
 
-static byte_buffer_t huff_unpack(bit_buffer_t * buf)
+// reads the rest of a length that didn't fit in its token, adding it to *n; returns 1 if it's cut off by the end of input, or -1 if it's more than max
+static int lz_load_length(const uint8_t * input, size_t input_len, size_t * pos, size_t * n, size_t max)
 {
-    buf->bit_index = 0;
-    buf->byte_index = 0;
-    size_t len = bits_pop(buf, 8*8);
-    
-    byte_buffer_t ret = {0, 0, 0};
-    bytes_reserve(&ret, len);
-    
-    huff_node_t * root = pop_huff_node(buf);
-    
-    for(size_t i = 0; i < len; i++)
+    uint8_t byte;
+    do
     {
-        huff_node_t * node = root;
-        node = node->children[bit_pop(buf)];
-        while (node->children[0])
-            node = node->children[bit_pop(buf)];
-        byte_push(&ret, node->symbol);
-    }
-    
-    free_huff_nodes(root);
-    
-    return ret;
+        if (*pos >= input_len)
+            return 1;
+        byte = input[(*pos)++];
+        *n += byte;
+        if (*n > max)
+            return -1;
+    } while (byte == 255);
+    return 0;
 }
 
-// passed-in data is modified, but not stored; it still belongs to the caller, and must be freed by the caller
-// returned data must be freed by the caller; it was allocated with BARPH_MALLOC
-static uint8_t * barph_compress(uint8_t * data, size_t len, uint8_t do_rle, uint8_t do_huff, uint8_t do_diff, size_t * out_len)
+// like rle_expand, but for LZ tokens: expands the whole tokens at the start of input into out, from *pos up to out_len, and sets *used to
+// how many bytes of input they took, leaving a token cut off by the end of input for the next call. matches copy from what's already in out,
+// so out has to hold everything since the start of the data. returns nonzero if the tokens don't fit in out, or reach back before its start
+static int lz_expand(uint8_t * out, size_t out_len, size_t * pos, const uint8_t * input, size_t input_len, size_t * used)
 {
-    if (!data || !out_len) return 0;
-    
-    byte_buffer_t buf = {data, len, len};
-    
-    const uint32_t big_prime = 0x1011B0D5;
-    uint32_t checksum = 0x87654321;
-    
-    for (size_t i = 0; i < len; i += 1)
-        checksum = (checksum ^ buf.data[i] ^ i) * big_prime;
+    size_t i = 0;
+    size_t o = *pos;
+    int failed = 0;
     
-    if (do_diff)
-    {
-        for (size_t i = buf.len - 1; i >= do_diff; i -= 1)
-            buf.data[i] -= buf.data[i - do_diff];
-    }
-    if (do_rle)
-    {
-        byte_buffer_t new_buf = super_big_rle_compress(buf.data, buf.len);
-        if (buf.data != data)
-            BARPH_FREE(buf.data);
-        buf = new_buf;
-    }
-    if (do_huff)
+    while (i < input_len)
     {
-        byte_buffer_t new_buf = huff_pack(buf.data, buf.len).buffer;
-        if (buf.data != data)
-            BARPH_FREE(buf.data);
-        buf = new_buf;
+        // the whole token is read and checked before anything is copied
+        uint8_t token = input[i];
+        size_t p = i + 1;
+        size_t literals = token >> 4;
+        size_t match = token & 15;
+        uint64_t offset = 0;
+        // 1 if the token is cut off, -1 if it's malformed
+        int cut = 0;
+        if (literals == 15)
+            cut = lz_load_length(input, input_len, &p, &literals, BARPH_LZ_MAX_LITERALS);
+        if (!cut && literals > input_len - p)
+            cut = 1;
+        const uint8_t * literal_data = &input[p];
+        if (!cut && match)
+        {
+            p += literals;
+            size_t offset_at = p;
+            // a varint can't be longer than 10 bytes, so one that fails with that many left is malformed
+            if (load_varint(input, input_len, &p, &offset) != 0)
+                cut = input_len - offset_at < 10 ? 1 : -1;
+            match += 3;
+            if (!cut && match == 18)
+                cut = lz_load_length(input, input_len, &p, &match, BARPH_LZ_MAX_MATCH);
+        }
+        else
+            p += literals;
+        if (cut)
+        {
+            failed = cut < 0 ? -1 : 0;
+            break;
+        }
+        if (literals + match > out_len - o || (match && (offset == 0 || offset > o + literals)))
+        {
+            failed = -1;
+            break;
+        }
+        
+        uint8_t * dest = &out[o];
+        if (literals <= BARPH_RLE_SLACK && out_len - o >= BARPH_RLE_SLACK && (size_t)(&input[input_len] - literal_data) >= BARPH_RLE_SLACK)
+            memcpy(dest, literal_data, BARPH_RLE_SLACK);
+        else
+            memcpy(dest, literal_data, literals);
+        dest += literals;
+        
+        // a match at least 16 bytes back can be copied 16 bytes at a time, even though it overlaps what it's copying;
+        // closer ones copy their first repeat, and then double what's been written so far, like RLE's word runs
+        const uint8_t * from = dest - offset;
+        if (offset >= 16 && out_len - o - literals - match >= 16)
+        {
+            for (size_t k = 0; k < match; k += 16)
+                memcpy(&dest[k], &from[k], 16);
+        }
+        else if (match)
+        {
+            size_t done = offset < match ? offset : match;
+            memcpy(dest, from, done);
+            while (done < match)
+            {
+                size_t count = done < match - done ? done : match - done;
+                memcpy(&dest[done], dest, count);
+                done += count;
+            }
+        }
+        o += literals + match;
+        i = p;
     }
     
-    byte_buffer_t real_buf = {0, 0, 0};
-    bytes_reserve(&real_buf, buf.len + 8 + 4);
-    
-    bytes_push(&real_buf, (const uint8_t *)"bRPH", 5);
-    byte_push(&real_buf, do_diff);
-    byte_push(&real_buf, do_rle);
-    byte_push(&real_buf, do_huff);
-    bytes_push(&real_buf, (uint8_t *)&checksum, 4);
-    bytes_push(&real_buf, buf.data, buf.len);
-    
-    if (buf.data != data)
-        BARPH_FREE(buf.data);
-    
-    *out_len = real_buf.len;
-    return real_buf.data;
+    *pos = o;
+    *used = i;
+    return failed;
 }
+
+// like rle_expanded_size
+static int lz_expanded_size(const uint8_t * input, size_t input_len, uint64_t * size)
+{
+    if (input_len < 8)
+        return -1;
+    *size = load_u64le(input);
+    // a match with its length in one extra byte makes at most 272 bytes out of 3, and every byte after that adds 255
+    return *size / 256 > input_len - 8 ? -1 : 0;
+}
+
+// the RLE stage is RLE for do_rle 1 and LZ77 for do_rle 2 (BARPH_RLE_LZ); these pick between them
+
+// appends to out; tables is only used by LZ77, which reaches back at most window bytes (0 for the default). returns nonzero if it runs out of memory
+static int barph_rle_compress(byte_buffer_t * out, byte_buffer_t * tables, const uint8_t * input, size_t input_len, uint8_t do_rle, size_t window)
+{
+    if (do_rle == BARPH_RLE_LZ)
+        return lz_compress(out, tables, input, input_len, window);
+    return super_big_rle_compress(out, input, input_len);
+}
+
+// like rle_expanded_size
+static int barph_rle_expanded_size(uint8_t do_rle, const uint8_t * input, size_t input_len, uint64_t * size)
+{
+    if (do_rle == BARPH_RLE_LZ)
+        return lz_expanded_size(input, input_len, size);
+    return rle_expanded_size(input, input_len, size);
+}
+
+static int barph_rle_expand(uint8_t do_rle, uint8_t * out, size_t out_len, size_t * pos, const uint8_t * input, size_t input_len, size_t * used)
+{
+    if (do_rle == BARPH_RLE_LZ)
+        return lz_expand(out, out_len, pos, input, input_len, used);
+    return rle_expand(out, out_len, pos, input, input_len, used);
+}
+
+// expands all of input (after its length) into exactly out_len bytes at out; returns nonzero if it doesn't fill them exactly
+static int barph_rle_expand_all(uint8_t do_rle, uint8_t * out, size_t out_len, const uint8_t * input, size_t input_len)
+{
+    size_t pos = 0;
+    size_t used = 0;
+    if (barph_rle_expand(do_rle, out, out_len, &pos, &input[8], input_len - 8, &used) != 0)
+        return -1;
+    return (used == input_len - 8 && pos == out_len) ? 0 : -1;
+}
+
+// replaces the contents of out, reusing its memory; returns nonzero if the data is malformed
+BARPH_API int barph_rle_decompress(byte_buffer_t * out, const uint8_t * input, size_t input_len, uint8_t do_rle)
+{
+    out->len = 0;
+    uint64_t size;
+    if (barph_rle_expanded_size(do_rle, input, input_len, &size) != 0)
+        return -1;
+    if (size > SIZE_MAX || bytes_reserve(out, size) != 0 || barph_rle_expand_all(do_rle, out->data, size, input, input_len) != 0)
+        return -1;
+    out->len = size;
+    return 0;
+}
+
+// huffman codes are canonical and limited to BARPH_HUFF_MAX_BITS bits
+// do_huff 1 stores the code as a tree, for compatibility with old decoders; do_huff 2 stores just the code lengths
+// do_huff 3 stores the code lengths too, but splits the data into four streams that can be decoded side by side
+// do_huff 4 uses the code of a pre-shared dictionary (barph_dict_t), and stores only its ID
+// do_huff 5 isn't Huffman coding at all, but tANS, which takes the stage's place (see ans_pack)
+
+#define BARPH_HUFF_DICT 4
+#define BARPH_HUFF_ANS 5
+
+// do_huff values above this can't be decoded
+#define BARPH_HUFF_MAX_MODE 5
+
+#ifndef BARPH_HUFF_MAX_BITS
+#define BARPH_HUFF_MAX_BITS 15
+#endif
+
+typedef struct {
+    // bit-reversed, so that they can be pushed into the stream lowest bit first
+    uint32_t codes[256];
+    uint8_t lengths[256];
+} huff_codes_t;
+
+// flat tree; node 0 is the root, and leaves have no children
+typedef struct {
+    uint16_t children[511][2];
+    uint8_t symbols[511];
+    uint16_t node_count;
+} huff_tree_t;
+
+static int count_compare(const void * a, const void * b)
+{
+    int64_t n = *((int64_t*)b) - *((int64_t*)a);
+    return n > 0 ? 1 : n < 0 ? -1 : 0;
+}
+
+// builds length-limited code lengths from byte counts
+// at least two symbols always get a code, so that the tree is never a lone leaf
+static void huff_build_lengths(const uint64_t * counts, uint8_t * lengths)
+{
+    // sort used bytes by count, with the byte identity stuffed into the bottom 8 bits
+    uint64_t sorted[256];
+    size_t n = 0;
+    for (size_t b = 0; b < 256; b++)
+    {
+        lengths[b] = 0;
+        if (counts[b])
+            sorted[n++] = (counts[b] << 8) | b;
+    }
+    for (size_t b = 0; n < 2; b++)
+    {
+        if (!counts[b])
+            sorted[n++] = b;
+    }
+    qsort(sorted, n, sizeof(uint64_t), count_compare);
+    
+    // package-merge: the optimal code lengths under the length limit
+    // each level's list merges the leaves with pairs of items from the level below; only whether each item is a pair needs to be remembered
+    uint64_t weights[2][511];
+    uint8_t is_package[BARPH_HUFF_MAX_BITS][511];
+    size_t list_len = n;
+    for (size_t i = 0; i < n; i++)
+    {
+        weights[BARPH_HUFF_MAX_BITS % 2][i] = sorted[n - i - 1] >> 8;
+        is_package[BARPH_HUFF_MAX_BITS - 1][i] = 0;
+    }
+    for (size_t level = BARPH_HUFF_MAX_BITS - 1; level > 0; level--)
+    {
+        const uint64_t * below = weights[(level + 1) % 2];
+        uint64_t * list = weights[level % 2];
+        size_t packages = list_len / 2;
+        size_t leaf = 0;
+        size_t package = 0;
+        list_len = n + packages;
+        for (size_t i = 0; i < list_len; i++)
+        {
+            uint64_t package_weight = package < packages ? below[package * 2] + below[package * 2 + 1] : 0;
+            if (leaf < n && (package >= packages || (sorted[n - leaf - 1] >> 8) <= package_weight))
+            {
+                list[i] = sorted[n - leaf - 1] >> 8;
+                is_package[level - 1][i] = 0;
+                leaf++;
+            }
+            else
+            {
+                list[i] = package_weight;
+                is_package[level - 1][i] = 1;
+                package++;
+            }
+        }
+    }
+    
+    // the first 2n-2 items of the top list are the chosen ones; every time a leaf is chosen, at any level, its code gets one bit longer
+    uint16_t depth[256] = {0};
+    size_t chosen = n * 2 - 2;
+    for (size_t level = 0; level < BARPH_HUFF_MAX_BITS; level++)
+    {
+        size_t packages = 0;
+        size_t leaves = 0;
+        for (size_t i = 0; i < chosen; i++)
+        {
+            if (is_package[level][i])
+                packages++;
+            else
+                depth[leaves++] += 1;
+        }
+        chosen = packages * 2;
+    }
+    
+    for (size_t i = 0; i < n; i++)
+        lengths[sorted[n - i - 1] & 0xFF] = depth[i];
+}
+
+// assigns canonical codes to the given lengths; returns nonzero if they don't describe a complete prefix code
+static int huff_build_codes(huff_codes_t * codes, const uint8_t * lengths)
+{
+    size_t length_counts[BARPH_HUFF_MAX_BITS + 1] = {0};
+    uint32_t used = 0;
+    for (size_t b = 0; b < 256; b++)
+    {
+        codes->lengths[b] = lengths[b];
+        if (lengths[b] > BARPH_HUFF_MAX_BITS)
+            return -1;
+        if (lengths[b])
+        {
+            length_counts[lengths[b]] += 1;
+            used += ((uint32_t)1 << BARPH_HUFF_MAX_BITS) >> lengths[b];
+        }
+    }
+    if (used != ((uint32_t)1 << BARPH_HUFF_MAX_BITS))
+        return -1;
+    
+    uint32_t next_code[BARPH_HUFF_MAX_BITS + 1];
+    uint32_t code = 0;
+    for (size_t bits = 1; bits <= BARPH_HUFF_MAX_BITS; bits++)
+    {
+        code = (code + length_counts[bits - 1]) << 1;
+        next_code[bits] = code;
+    }
+    next_code[0] = 0;
+    length_counts[0] = 0;
+    for (size_t b = 0; b < 256; b++)
+    {
+        codes->codes[b] = 0;
+        if (!lengths[b])
+            continue;
+        uint32_t c = next_code[lengths[b]]++;
+        for (size_t n = 0; n < lengths[b]; n++)
+            codes->codes[b] |= ((c >> n) & 1) << (lengths[b] - n - 1);
+    }
+    return 0;
+}
+
+// inserts every code into a flat tree; the codes must be complete, as from huff_build_codes
+static void huff_tree_from_codes(huff_tree_t * tree, const huff_codes_t * codes)
+{
+    tree->node_count = 1;
+    tree->children[0][0] = 0;
+    tree->children[0][1] = 0;
+    for (size_t b = 0; b < 256; b++)
+    {
+        uint16_t node = 0;
+        for (size_t n = 0; n < codes->lengths[b]; n++)
+        {
+            uint8_t bit = (codes->codes[b] >> n) & 1;
+            if (!tree->children[node][bit])
+            {
+                uint16_t child = tree->node_count++;
+                tree->children[child][0] = 0;
+                tree->children[child][1] = 0;
+                tree->children[node][bit] = child;
+            }
+            node = tree->children[node][bit];
+        }
+        tree->symbols[node] = b;
+    }
+}
+
+static void push_huff_node(bit_writer_t * w, const huff_tree_t * tree, uint16_t node)
+{
+    if (tree->children[node][0])
+    {
+        bits_write(w, 1, 1);
+        push_huff_node(w, tree, tree->children[node][0]);
+        push_huff_node(w, tree, tree->children[node][1]);
+    }
+    else
+        bits_write(w, ((uint32_t)tree->symbols[node]) << 1, 9);
+}
+
+// code lengths are stored as four bits each, with a zero length followed by four more bits of extra zero lengths
+static void push_huff_lengths(bit_writer_t * w, const uint8_t * lengths)
+{
+    for (size_t b = 0; b < 256; b++)
+    {
+        if (lengths[b])
+        {
+            bits_write(w, lengths[b], 4);
+            continue;
+        }
+        size_t run = 0;
+        while (run < 15 && b + 1 < 256 && !lengths[b + 1])
+        {
+            run += 1;
+            b += 1;
+        }
+        bits_write(w, run << 4, 8);
+    }
+}
+
+static void huff_pack_symbols(bit_writer_t * w, const huff_codes_t * codes, const uint8_t * data, size_t len)
+{
+    // no code is longer than 15 bits, so three of them always fit in the accumulator at once
+    size_t i = 0;
+    for (; i + 3 <= len; i += 3)
+    {
+        uint64_t packed = codes->codes[data[i]];
+        uint8_t packed_bits = codes->lengths[data[i]];
+        packed |= ((uint64_t)codes->codes[data[i + 1]]) << packed_bits;
+        packed_bits += codes->lengths[data[i + 1]];
+        packed |= ((uint64_t)codes->codes[data[i + 2]]) << packed_bits;
+        packed_bits += codes->lengths[data[i + 2]];
+        bits_write(w, packed, packed_bits);
+    }
+    for (; i < len; i++)
+        bits_write(w, codes->codes[data[i]], codes->lengths[data[i]]);
+}
+
+// tANS, for do_huff 5: table-based asymmetric numeral systems, which spends a fraction of a bit on each byte where Huffman coding would spend
+// a whole number of bits, so it does much better on data that's mostly one byte. byte counts are scaled to frequencies that add up to 2^log
+// (log is stored, and at most BARPH_ANS_MAX_LOG), and those are spread over a table of 2^log states. decoding a byte is a lookup of the
+// current state, which gives the byte, and how many bits to read and add to what to get the next state, with no branches
+// four states take turns at the bytes, so that their lookups can overlap. the encoder works from the end of the data back, but the bits are
+// written in the order that the decoder reads them, so it reads forwards through an ordinary bit_reader_t, like Huffman's decoder
+
+#define BARPH_ANS_MIN_LOG 5
+#define BARPH_ANS_MAX_LOG 12
+#define BARPH_ANS_STATES 4
+
+// entries: bits 0-7 are the byte, bits 8-11 the number of bits to read, and bits 16-31 what they're added to for the next state
+typedef struct {
+    uint32_t entries[1 << BARPH_ANS_MAX_LOG];
+    uint8_t log;
+} ans_table_t;
+
+// scales byte counts to frequencies that add up to 2^log, keeping every byte that's there at 1 or more
+// what the rounding gains or loses goes to the bytes where it changes the output the least, about count / frequency bits each
+static void ans_normalize(const uint64_t * counts, uint64_t total, unsigned log, uint16_t * freqs)
+{
+    int32_t left = (int32_t)1 << log;
+    for (size_t b = 0; b < 256; b++)
+    {
+        uint64_t f = counts[b] * ((uint64_t)1 << log) / total;
+        freqs[b] = counts[b] ? (f ? (uint16_t)f : 1) : 0;
+        left -= freqs[b];
+    }
+    for (; left > 0; left--)
+    {
+        size_t best = 256;
+        for (size_t b = 0; b < 256; b++)
+        {
+            if (freqs[b] && (best == 256 || counts[b] * freqs[best] > counts[best] * freqs[b]))
+                best = b;
+        }
+        freqs[best] += 1;
+    }
+    for (; left < 0; left++)
+    {
+        size_t best = 256;
+        for (size_t b = 0; b < 256; b++)
+        {
+            if (freqs[b] > 1 && (best == 256 || counts[b] * (freqs[best] - 1) < counts[best] * (freqs[b] - 1)))
+                best = b;
+        }
+        freqs[best] -= 1;
+    }
+}
+
+// gives each byte freqs[b] states, scattered through the table so that each byte's states are spread evenly over it
+// the step is odd and the table size is a power of two, so every state is visited exactly once
+static void ans_spread(const uint16_t * freqs, unsigned log, uint8_t * symbols)
+{
+    uint32_t mask = ((uint32_t)1 << log) - 1;
+    uint32_t step = (mask >> 1) + (mask >> 3) + 3;
+    uint32_t pos = 0;
+    for (size_t b = 0; b < 256; b++)
+    {
+        for (uint32_t i = 0; i < freqs[b]; i++)
+        {
+            symbols[pos] = (uint8_t)b;
+            pos = (pos + step) & mask;
+        }
+    }
+}
+
+// frequencies are stored after log (four bits), like code lengths: a zero is four zero bits followed by four bits of extra zeros,
+// and anything else is its number of bits (four bits) followed by the bits below its top one
+static void push_ans_freqs(bit_writer_t * w, unsigned log, const uint16_t * freqs)
+{
+    bits_write(w, log, 4);
+    for (size_t b = 0; b < 256; b++)
+    {
+        if (freqs[b])
+        {
+            unsigned top = barph_top_bit64(freqs[b]);
+            bits_write(w, (top + 1) | ((uint32_t)(freqs[b] - (1 << top)) << 4), top + 4);
+            continue;
+        }
+        size_t run = 0;
+        while (run < 15 && b + 1 < 256 && !freqs[b + 1])
+        {
+            run += 1;
+            b += 1;
+        }
+        bits_write(w, run << 4, 8);
+    }
+}
+
+// reads what push_ans_freqs wrote; returns nonzero if it's malformed, or the frequencies don't add up to 2^log
+static int pop_ans_freqs(unsigned * log, uint16_t * freqs, bit_reader_t * r)
+{
+    *log = bits_read(r, 4);
+    if (*log < BARPH_ANS_MIN_LOG || *log > BARPH_ANS_MAX_LOG)
+        return -1;
+    uint32_t total = 0;
+    for (size_t b = 0; b < 256; b++)
+    {
+        unsigned bits = bits_read(r, 4);
+        if (bits)
+        {
+            if (bits > *log + 1)
+                return -1;
+            freqs[b] = (uint16_t)((1 << (bits - 1)) | bits_read(r, bits - 1));
+            total += freqs[b];
+            continue;
+        }
+        freqs[b] = 0;
+        size_t run = bits_read(r, 4);
+        if (b + run >= 256)
+            return -1;
+        for (; run > 0; run--)
+            freqs[++b] = 0;
+    }
+    return total == ((uint32_t)1 << *log) ? 0 : -1;
+}
+
+// encoding a byte from state x (from 2^log to 2^(log + 1) - 1) writes out its bottom bits, as many as it takes to bring x into the range
+// from freqs[b] to 2 * freqs[b] - 1, then moves to the state that what's left picks out from among b's states in the table
+typedef struct {
+    // added to x, the number of bits is in the top 16 bits
+    uint32_t delta_bits[256];
+    // added to what's left of x, the index into next
+    int32_t delta_state[256];
+    // every byte's states, in table order
+    uint16_t next[1 << BARPH_ANS_MAX_LOG];
+} ans_encoder_t;
+
+static void ans_encoder_init(ans_encoder_t * e, const uint16_t * freqs, unsigned log)
+{
+    uint8_t symbols[1 << BARPH_ANS_MAX_LOG];
+    uint32_t cursor[256];
+    uint32_t cumulative = 0;
+    ans_spread(freqs, log, symbols);
+    for (size_t b = 0; b < 256; b++)
+    {
+        // the number of bits is max_bits for states at or above freqs[b] << max_bits, and one fewer below
+        unsigned max_bits = log - (freqs[b] > 1 ? barph_top_bit64(freqs[b] - 1) : 0);
+        e->delta_bits[b] = (max_bits << 16) - ((uint32_t)freqs[b] << max_bits);
+        e->delta_state[b] = (int32_t)cumulative - freqs[b];
+        cursor[b] = cumulative;
+        cumulative += freqs[b];
+    }
+    for (uint32_t u = 0; u < ((uint32_t)1 << log); u++)
+        e->next[cursor[symbols[u]]++] = (uint16_t)(((uint32_t)1 << log) + u);
+}
+
+// encodes b from *x, and returns the bits it writes out: at most 12, with how many in the top four bits of 16
+static inline uint32_t ans_encode_one(const ans_encoder_t * e, uint32_t * x, uint8_t b)
+{
+    uint32_t bits = (*x + e->delta_bits[b]) >> 16;
+    uint32_t chunk = (*x & (((uint32_t)1 << bits) - 1)) | (bits << 12);
+    *x = e->next[(*x >> bits) + e->delta_state[b]];
+    return chunk;
+}
+
+static void ans_store_chunk(uint8_t * pending, size_t i, uint32_t chunk)
+{
+    pending[i * 2] = (uint8_t)chunk;
+    pending[i * 2 + 1] = (uint8_t)(chunk >> 8);
+}
+
+// appends to out: the length (8 bytes), the frequencies, the four states the decoder starts from (log bits each), then the bits read for each byte
+// returns nonzero if it runs out of memory
+static int ans_pack(byte_buffer_t * out, const uint8_t * data, size_t len)
+{
+    uint64_t counts[256] = {0};
+    for (size_t i = 0; i < len; i += 1)
+        counts[data[i]] += 1;
+    size_t used = 0;
+    for (size_t b = 0; b < 256; b++)
+        used += counts[b] != 0;
+    if (!used)
+        counts[0] = used = 1;
+    
+    // small inputs get a smaller table, which is quicker to set up and to store
+    unsigned log = BARPH_ANS_MAX_LOG;
+    while (log > BARPH_ANS_MIN_LOG && ((size_t)1 << (log - 1)) >= len && ((size_t)1 << (log - 1)) >= used * 2)
+        log -= 1;
+    uint32_t size = (uint32_t)1 << log;
+    uint16_t freqs[256];
+    ans_normalize(counts, len ? len : 1, log, freqs);
+    ans_encoder_t e;
+    ans_encoder_init(&e, freqs, log);
+    
+    bit_writer_t w;
+    memset(&w, 0, sizeof(bit_writer_t));
+    w.buffer = *out;
+    // room for the header, and for two bytes per byte of input after it, plus a gap: see below
+    if (len > (SIZE_MAX - 4096) / 16 || bits_reserve(&w, 64 + 4 + 256 * 16 + (32 + (uint64_t)len * 2) * 8) != 0)
+        return -1;
+    
+    bits_write(&w, len & 0xFFFFFFFF, 32);
+    bits_write(&w, ((uint64_t)len) >> 32, 32);
+    push_ans_freqs(&w, log, freqs);
+    
+    // the bits for each byte are found backwards, so they're kept a little past where they'll be written in the end, which is far enough,
+    // since they're written out at no more than 12 bits for every 16 read
+    // byte i is coded with state i % 4, so the bytes past the last multiple of 4 go first
+    uint8_t * pending = &w.buffer.data[w.buffer.len + 32];
+    uint32_t x[BARPH_ANS_STATES] = {size, size, size, size};
+    size_t i = len;
+    for (; i % 4; i--)
+        ans_store_chunk(pending, i - 1, ans_encode_one(&e, &x[(i - 1) % 4], data[i - 1]));
+    uint32_t x0 = x[0], x1 = x[1], x2 = x[2], x3 = x[3];
+    for (; i > 0; i -= 4)
+    {
+        uint32_t c3 = ans_encode_one(&e, &x3, data[i - 1]);
+        uint32_t c2 = ans_encode_one(&e, &x2, data[i - 2]);
+        uint32_t c1 = ans_encode_one(&e, &x1, data[i - 3]);
+        uint32_t c0 = ans_encode_one(&e, &x0, data[i - 4]);
+        ans_store_chunk(pending, i - 1, c3);
+        ans_store_chunk(pending, i - 2, c2);
+        ans_store_chunk(pending, i - 3, c1);
+        ans_store_chunk(pending, i - 4, c0);
+    }
+    x[0] = x0;
+    x[1] = x1;
+    x[2] = x2;
+    x[3] = x3;
+    
+    for (size_t k = 0; k < BARPH_ANS_STATES; k++)
+        bits_write(&w, x[k] - size, log);
+    // four bytes' bits are at most 48, so they can be written at once
+    for (; i + 4 <= len; i += 4)
+    {
+        uint64_t packed = 0;
+        uint8_t packed_bits = 0;
+        for (size_t k = 0; k < 4; k++)
+        {
+            uint32_t chunk = pending[(i + k) * 2] | ((uint32_t)pending[(i + k) * 2 + 1] << 8);
+            packed |= (uint64_t)(chunk & 0xFFF) << packed_bits;
+            packed_bits += chunk >> 12;
+        }
+        bits_write(&w, packed, packed_bits);
+    }
+    for (; i < len; i++)
+    {
+        uint32_t chunk = pending[i * 2] | ((uint32_t)pending[i * 2 + 1] << 8);
+        bits_write(&w, chunk & 0xFFF, chunk >> 12);
+    }
+    bits_flush(&w);
+    
+    *out = w.buffer;
+    return 0;
+}
+
+// reads the frequencies at the given bit position and builds the decoding table for them; returns nonzero if they're malformed
+static int ans_table_init(ans_table_t * t, bit_reader_t * r)
+{
+    unsigned log;
+    uint16_t freqs[256];
+    if (pop_ans_freqs(&log, freqs, r) != 0)
+        return -1;
+    
+    // each of a byte's states, in table order, stands for x from freqs[b] to 2 * freqs[b] - 1, which the decoder shifts back up into the
+    // range from 2^log to 2^(log + 1) - 1 with the bits it reads, the same way the encoder shifted them out
+    uint8_t symbols[1 << BARPH_ANS_MAX_LOG];
+    uint32_t x[256];
+    ans_spread(freqs, log, symbols);
+    for (size_t b = 0; b < 256; b++)
+        x[b] = freqs[b];
+    t->log = (uint8_t)log;
+    for (uint32_t u = 0; u < ((uint32_t)1 << log); u++)
+    {
+        uint8_t b = symbols[u];
+        uint32_t bits = log - barph_top_bit64(x[b]);
+        t->entries[u] = b | (bits << 8) | (((x[b] << bits) - ((uint32_t)1 << log)) << 16);
+        x[b] += 1;
+    }
+    return 0;
+}
+
+// reads the states that decoding starts from, which come right before the bits for the first byte
+static void ans_load_states(const ans_table_t * t, bit_reader_t * r, uint32_t * states)
+{
+    for (size_t k = 0; k < BARPH_ANS_STATES; k++)
+        states[k] = bits_read(r, t->log);
+}
+
+// whatever bits are read, the next state is always in the table, so malformed data can't make it read outside of it
+static inline uint8_t ans_decode_one(const uint32_t * entries, bit_reader_t * r, uint32_t * state)
+{
+    uint32_t entry = entries[*state];
+    uint32_t bits = (entry >> 8) & 0xF;
+    *state = (entry >> 16) + (uint32_t)(r->acc & (((uint32_t)1 << bits) - 1));
+    bits_consume(r, bits);
+    return (uint8_t)entry;
+}
+
+// decodes len bytes into out, carrying on from the given states, and leaves them ready for the byte after; the next byte always uses states[0]
+// the reader is copied into a local, so that it can stay in registers
+static void ans_unpack_symbols(const ans_table_t * t, uint32_t * states, bit_reader_t * reader, uint8_t * out, size_t len)
+{
+    const uint32_t * entries = t->entries;
+    bit_reader_t r = *reader;
+    uint32_t s[BARPH_ANS_STATES] = {states[0], states[1], states[2], states[3]};
+    size_t i = 0;
+    // a refill gives at least 56 bits, and each byte takes at most 12
+    for (; i + 4 <= len; i += 4)
+    {
+        bits_refill(&r);
+        out[i] = ans_decode_one(entries, &r, &s[0]);
+        out[i + 1] = ans_decode_one(entries, &r, &s[1]);
+        out[i + 2] = ans_decode_one(entries, &r, &s[2]);
+        out[i + 3] = ans_decode_one(entries, &r, &s[3]);
+    }
+    size_t tail = len - i;
+    for (size_t k = 0; k < tail; k++)
+    {
+        bits_refill(&r);
+        out[i + k] = ans_decode_one(entries, &r, &s[k]);
+    }
+    for (size_t k = 0; k < BARPH_ANS_STATES; k++)
+        states[k] = s[(k + tail) & 3];
+    *reader = r;
+}
+
+// builds the code for the given byte counts of len bytes, and starts w on out with everything that comes before the coded bytes, with room for all of them
+// returns nonzero if it can't make the room, and then nothing is written
+static int huff_pack_header(bit_writer_t * w, huff_codes_t * codes, byte_buffer_t * out, const uint64_t * counts, size_t len, uint8_t do_huff)
+{
+    uint8_t lengths[256];
+    huff_build_lengths(counts, lengths);
+    huff_build_codes(codes, lengths);
+    
+    // the output size is known exactly up front, short of the stored code, which is at most 511 nodes of 9 bits each,
+    // and the stream lengths and padding for four streams
+    size_t bits = 64 + 511 * 9 + 24 * 8 + 5 * 8;
+    for (size_t b = 0; b < 256; b++)
+        bits += counts[b] * codes->lengths[b];
+    
+    memset(w, 0, sizeof(bit_writer_t));
+    w->buffer = *out;
+    if (bits_reserve(w, bits) != 0)
+        return -1;
+    
+    bits_write(w, len & 0xFFFFFFFF, 32);
+    bits_write(w, ((uint64_t)len) >> 32, 32);
+    
+    if (do_huff == 1)
+    {
+        huff_tree_t tree;
+        huff_tree_from_codes(&tree, codes);
+        push_huff_node(w, &tree, 0);
+    }
+    else
+        push_huff_lengths(w, lengths);
+    return 0;
+}
+
+// appends to out; returns nonzero if it runs out of memory
+static int huff_pack(byte_buffer_t * out, const uint8_t * data, size_t len, uint8_t do_huff)
+{
+    if (do_huff == BARPH_HUFF_ANS)
+        return ans_pack(out, data, len);
+    
+    uint64_t counts[256] = {0};
+    for (size_t i = 0; i < len; i += 1)
+        counts[data[i]] += 1;
+    
+    bit_writer_t w;
+    huff_codes_t codes;
+    if (huff_pack_header(&w, &codes, out, counts, len, do_huff) != 0)
+        return -1;
+    
+    if (do_huff == 3)
+    {
+        // each stream covers a quarter of the data, and starts on a byte boundary; the byte lengths of the first three (8 bytes each) come first
+        bits_flush(&w);
+        size_t lengths_at = w.buffer.len;
+        w.buffer.len += 24;
+        size_t quarter = (len + 3) / 4;
+        for (size_t k = 0; k < 4; k++)
+        {
+            size_t start = k * quarter < len ? k * quarter : len;
+            size_t end = len - start < quarter ? len : start + quarter;
+            size_t stream_start = w.buffer.len;
+            huff_pack_symbols(&w, &codes, &data[start], end - start);
+            bits_flush(&w);
+            if (k < 3)
+                store_u64le(&w.buffer.data[lengths_at + k * 8], w.buffer.len - stream_start);
+        }
+        *out = w.buffer;
+        return 0;
+    }
+    
+    huff_pack_symbols(&w, &codes, data, len);
+    bits_flush(&w);
+    
+    *out = w.buffer;
+    return 0;
+}
+
+// table-driven decoding
+// the next BARPH_HUFF_TABLE_BITS bits of the stream index into a table that resolves one or two whole symbols at once
+// longer codes go through a second-level table, and codes too deep for both levels walk the flat tree one bit at a time
+
+#ifndef BARPH_HUFF_TABLE_BITS
+#define BARPH_HUFF_TABLE_BITS 11
+#endif
+
+#define BARPH_HUFF_SUB_BITS 8
+#define BARPH_HUFF_SUB_POOL 4096
+
+// entries: bits 0-7 are the first symbol, bits 8-15 the second, bits 16-21 the number of bits consumed, bits 22-23 the number of symbols
+// entries with no symbols are links: bits 0-15 are a subtable offset, or a tree node if the subtable size (bits 16-19) is zero
+#define HUFF_ENTRY(sym0, sym1, bits, count) ((uint32_t)(sym0) | ((uint32_t)(sym1) << 8) | ((uint32_t)(bits) << 16) | ((uint32_t)(count) << 22))
+#define HUFF_LINK(index, sub_bits) ((uint32_t)(index) | ((uint32_t)(sub_bits) << 16))
+
+typedef struct {
+    uint32_t table[1 << BARPH_HUFF_TABLE_BITS];
+    uint32_t sub[BARPH_HUFF_SUB_POOL];
+    size_t sub_len;
+    huff_tree_t tree;
+    // built instead of the others for do_huff 5
+    ans_table_t ans;
+} huff_table_t;
+
+// reads a tree as written by push_huff_node; returns the new node's index, or -1 if the tree is malformed
+static int huff_tree_pop(huff_tree_t * tree, bit_reader_t * r)
+{
+    if (tree->node_count >= 511)
+        return -1;
+    int node = tree->node_count++;
+    
+    tree->children[node][0] = 0;
+    tree->children[node][1] = 0;
+    tree->symbols[node] = 0;
+    if (bits_read(r, 1))
+    {
+        int child_0 = huff_tree_pop(tree, r);
+        if (child_0 < 0)
+            return -1;
+        int child_1 = huff_tree_pop(tree, r);
+        if (child_1 < 0)
+            return -1;
+        tree->children[node][0] = child_0;
+        tree->children[node][1] = child_1;
+    }
+    else
+    {
+        tree->symbols[node] = bits_read(r, 8);
+    }
+    return node;
+}
+
+// reads code lengths as written by push_huff_lengths; returns nonzero if they're malformed
+static int pop_huff_lengths(uint8_t * lengths, bit_reader_t * r)
+{
+    for (size_t b = 0; b < 256; b++)
+    {
+        lengths[b] = bits_read(r, 4);
+        if (lengths[b])
+            continue;
+        size_t run = bits_read(r, 4);
+        if (b + run >= 256)
+            return -1;
+        for (; run > 0; run--)
+            lengths[++b] = 0;
+    }
+    return 0;
+}
+
+static size_t huff_tree_depth(const huff_tree_t * tree, uint16_t node)
+{
+    if (!tree->children[node][0])
+        return 0;
+    size_t a = huff_tree_depth(tree, tree->children[node][0]);
+    size_t b = huff_tree_depth(tree, tree->children[node][1]);
+    return (a > b ? a : b) + 1;
+}
+
+// codes are indexed in stream order: the first bit of a code is bit 0 of its table index
+static void huff_sub_fill(huff_table_t * t, size_t offset, size_t sub_bits, uint16_t node, uint32_t code, size_t depth)
+{
+    if (!t->tree.children[node][0])
+    {
+        for (uint32_t i = code; i < ((uint32_t)1 << sub_bits); i += (uint32_t)1 << depth)
+            t->sub[offset + i] = HUFF_ENTRY(t->tree.symbols[node], 0, depth, 1);
+    }
+    else if (depth == sub_bits)
+        t->sub[offset + code] = HUFF_LINK(node, 0);
+    else
+    {
+        huff_sub_fill(t, offset, sub_bits, t->tree.children[node][0], code, depth + 1);
+        huff_sub_fill(t, offset, sub_bits, t->tree.children[node][1], code | ((uint32_t)1 << depth), depth + 1);
+    }
+}
+
+static uint32_t huff_table_link(huff_table_t * t, uint16_t node)
+{
+    size_t sub_bits = huff_tree_depth(&t->tree, node);
+    if (sub_bits > BARPH_HUFF_SUB_BITS)
+        sub_bits = BARPH_HUFF_SUB_BITS;
+    // out of subtable space; fall back to walking the tree
+    if (t->sub_len + ((size_t)1 << sub_bits) > BARPH_HUFF_SUB_POOL)
+        return HUFF_LINK(node, 0);
+    
+    size_t offset = t->sub_len;
+    t->sub_len += (size_t)1 << sub_bits;
+    huff_sub_fill(t, offset, sub_bits, node, 0, 0);
+    return HUFF_LINK(offset, sub_bits);
+}
+
+static void huff_table_fill(huff_table_t * t, uint16_t node, uint32_t code, size_t depth)
+{
+    if (!t->tree.children[node][0])
+    {
+        for (uint32_t i = code; i < (1 << BARPH_HUFF_TABLE_BITS); i += (uint32_t)1 << depth)
+            t->table[i] = HUFF_ENTRY(t->tree.symbols[node], 0, depth, 1);
+    }
+    else if (depth == BARPH_HUFF_TABLE_BITS)
+        t->table[code] = huff_table_link(t, node);
+    else
+    {
+        huff_table_fill(t, t->tree.children[node][0], code, depth + 1);
+        huff_table_fill(t, t->tree.children[node][1], code | ((uint32_t)1 << depth), depth + 1);
+    }
+}
+
+// builds the decoding tables for the code in t->tree
+static void huff_table_build(huff_table_t * t)
+{
+    t->sub_len = 0;
+    huff_table_fill(t, 0, 0, 0);
+    
+    // pair up short codes so that a single lookup can resolve two symbols
+    // going downwards means that the entry for the remaining bits hasn't been paired yet
+    for (size_t i = (1 << BARPH_HUFF_TABLE_BITS); i > 0; i -= 1)
+    {
+        uint32_t entry = t->table[i - 1];
+        size_t bits = (entry >> 16) & 0x3F;
+        if ((entry >> 22) != 1 || bits == 0)
+            continue;
+        uint32_t next = t->table[(i - 1) >> bits];
+        size_t next_bits = (next >> 16) & 0x3F;
+        if ((next >> 22) == 1 && bits + next_bits <= BARPH_HUFF_TABLE_BITS)
+            t->table[i - 1] = HUFF_ENTRY(entry & 0xFF, next & 0xFF, bits + next_bits, 2);
+    }
+}
+
+// reads the stored code at the given bit position and builds the decoding tables for it; returns nonzero if the code is malformed
+static int huff_table_init(huff_table_t * t, uint8_t do_huff, bit_reader_t * r)
+{
+    t->tree.node_count = 0;
+    if (do_huff == 1)
+    {
+        if (huff_tree_pop(&t->tree, r) < 0)
+            return -1;
+    }
+    else
+    {
+        uint8_t lengths[256];
+        huff_codes_t codes;
+        if (pop_huff_lengths(lengths, r) != 0 || huff_build_codes(&codes, lengths) != 0)
+            return -1;
+        huff_tree_from_codes(&t->tree, &codes);
+    }
+    huff_table_build(t);
+    return 0;
+}
+
+// decodes a code longer than BARPH_HUFF_TABLE_BITS, given the link entry for its first bits; needs at least BARPH_HUFF_TABLE_BITS + BARPH_HUFF_SUB_BITS bits in the accumulator
+static uint8_t huff_decode_long(const huff_table_t * t, bit_reader_t * r, uint32_t entry)
+{
+    bits_consume(r, BARPH_HUFF_TABLE_BITS);
+    size_t sub_bits = (entry >> 16) & 0xF;
+    if (sub_bits)
+    {
+        entry = t->sub[(entry & 0xFFFF) + (r->acc & ((((uint32_t)1) << sub_bits) - 1))];
+        if (entry >> 22)
+        {
+            bits_consume(r, (entry >> 16) & 0x3F);
+            return entry;
+        }
+        bits_consume(r, sub_bits);
+    }
+    
+    // very long code
+    uint16_t node = entry & 0xFFFF;
+    while (t->tree.children[node][0])
+        node = t->tree.children[node][bits_read(r, 1)];
+    return t->tree.symbols[node];
+}
+
+// decodes one table entry at out, which needs room for two symbols; returns how many symbols it was
+static inline size_t huff_decode_one(const huff_table_t * t, bit_reader_t * r, uint8_t * out)
+{
+    uint32_t entry = t->table[r->acc & ((1 << BARPH_HUFF_TABLE_BITS) - 1)];
+    if (!(entry >> 22))
+    {
+        out[0] = huff_decode_long(t, r, entry);
+        return 1;
+    }
+    out[0] = entry;
+    out[1] = entry >> 8;
+    bits_consume(r, (entry >> 16) & 0x3F);
+    return entry >> 22;
+}
+
+// decodes the four streams of do_huff 3, which start at byte `pos` of the data; returns nonzero if they're malformed
+static int huff_unpack_streams(const huff_table_t * t, const uint8_t * data, size_t data_len, size_t pos, uint8_t * out, size_t len)
+{
+    if (data_len < pos || data_len - pos < 24)
+        return -1;
+    size_t offset = pos + 24;
+    
+    bit_reader_t r[4];
+    size_t at[4];
+    size_t end[4];
+    size_t quarter = (len + 3) / 4;
+    for (size_t k = 0; k < 4; k++)
+    {
+        uint64_t stream_len = k < 3 ? load_u64le(&data[pos + k * 8]) : data_len - offset;
+        if (stream_len > data_len - offset)
+            return -1;
+        bit_reader_t stream = {&data[offset], (size_t)stream_len, 0, 0, 0};
+        r[k] = stream;
+        offset += stream_len;
+        at[k] = k * quarter < len ? k * quarter : len;
+        end[k] = len - at[k] < quarter ? len : at[k] + quarter;
+    }
+    
+    // the same three lookups per refill as a single stream, but the streams don't depend on each other, so their lookups can overlap
+    // the readers are copied into locals so that they can stay in registers
+    bit_reader_t r0 = r[0], r1 = r[1], r2 = r[2], r3 = r[3];
+    uint8_t * o0 = &out[at[0]], * o1 = &out[at[1]], * o2 = &out[at[2]], * o3 = &out[at[3]];
+    while (o0 + 6 <= &out[end[0]] && o1 + 6 <= &out[end[1]] && o2 + 6 <= &out[end[2]] && o3 + 6 <= &out[end[3]])
+    {
+        bits_refill(&r0);
+        bits_refill(&r1);
+        bits_refill(&r2);
+        bits_refill(&r3);
+        for (size_t n = 0; n < 3; n++)
+        {
+            o0 += huff_decode_one(t, &r0, o0);
+            o1 += huff_decode_one(t, &r1, o1);
+            o2 += huff_decode_one(t, &r2, o2);
+            o3 += huff_decode_one(t, &r3, o3);
+        }
+    }
+    r[0] = r0;
+    r[1] = r1;
+    r[2] = r2;
+    r[3] = r3;
+    at[0] = o0 - out;
+    at[1] = o1 - out;
+    at[2] = o2 - out;
+    at[3] = o3 - out;
+    
+    // the ends of the streams are decoded one entry at a time, without writing into the next stream
+    for (size_t k = 0; k < 4; k++)
+    {
+        while (at[k] < end[k])
+        {
+            uint8_t pair[2];
+            bits_refill(&r[k]);
+            size_t count = huff_decode_one(t, &r[k], pair);
+            out[at[k]++] = pair[0];
+            if (count == 2 && at[k] < end[k])
+                out[at[k]++] = pair[1];
+        }
+    }
+    return 0;
+}
+
+// decodes len symbols from a single stream into out, which needs one byte of slack, and returns how many it decoded:
+// len, or len + 1 if the last entry had two symbols, in which case the extra one is the next symbol in the stream (or padding, at its end)
+// the reader is copied into a local, so that it can stay in registers
+static size_t huff_unpack_symbols(const huff_table_t * t, bit_reader_t * reader, uint8_t * out, size_t len)
+{
+    const uint32_t mask = (1 << BARPH_HUFF_TABLE_BITS) - 1;
+    bit_reader_t r = *reader;
+    size_t i = 0;
+    // a refill gives at least 56 bits, which covers three short lookups and whatever a long code needs after them
+    while (i + 6 <= len)
+    {
+        bits_refill(&r);
+        for (size_t k = 0; k < 3; k++)
+        {
+            uint32_t entry = t->table[r.acc & mask];
+            if (!(entry >> 22))
+            {
+                out[i++] = huff_decode_long(t, &r, entry);
+                break;
+            }
+            out[i] = entry;
+            out[i + 1] = entry >> 8;
+            i += entry >> 22;
+            bits_consume(&r, (entry >> 16) & 0x3F);
+        }
+    }
+    while (i < len)
+    {
+        bits_refill(&r);
+        uint32_t entry = t->table[r.acc & mask];
+        if (!(entry >> 22))
+        {
+            out[i++] = huff_decode_long(t, &r, entry);
+            continue;
+        }
+        out[i] = entry;
+        out[i + 1] = entry >> 8;
+        i += entry >> 22;
+        bits_consume(&r, (entry >> 16) & 0x3F);
+    }
+    *reader = r;
+    return i;
+}
+
+// reads the length and code at the start of Huffman data, building the decoding tables in t, and leaves r at the first symbol;
+// returns nonzero if the data is malformed or has more than max symbols
+static int huff_unpack_header(huff_table_t * t, bit_reader_t * r, size_t * len, uint8_t do_huff, uint64_t max)
+{
+    uint64_t n = bits_read(r, 32);
+    n |= ((uint64_t)bits_read(r, 32)) << 32;
+    // every Huffman code takes at least one bit, but a tANS symbol can take none, so only max bounds those
+    if (n > max || n >= SIZE_MAX || (do_huff != BARPH_HUFF_ANS && n / 8 > r->len))
+        return -1;
+    *len = n;
+    return do_huff == BARPH_HUFF_ANS ? ans_table_init(&t->ans, r) : huff_table_init(t, do_huff, r);
+}
+
+// replaces the contents of out, reusing its memory, and builds the decoding tables in t; returns nonzero if the data is malformed or has more than max symbols
+static int huff_unpack(byte_buffer_t * out_buf, huff_table_t * t, const uint8_t * data, size_t data_len, uint8_t do_huff, uint64_t max)
+{
+    bit_reader_t r = {data, data_len, 0, 0, 0};
+    size_t len;
+    
+    out_buf->len = 0;
+    if (huff_unpack_header(t, &r, &len, do_huff, max) != 0)
+        return -1;
+    
+    // one byte of slack, for two-symbol entries that decode past the end
+    if (bytes_reserve(out_buf, len + 1) != 0)
+        return -1;
+    uint8_t * out = out_buf->data;
+    
+    if (do_huff == 3)
+    {
+        // the streams start at the first whole byte after the code
+        size_t pos = (r.pos * 8 - r.acc_bits + 7) / 8;
+        if (huff_unpack_streams(t, data, data_len, pos, out, len) != 0)
+            return -1;
+        out_buf->len = len;
+        return 0;
+    }
+    if (do_huff == BARPH_HUFF_ANS)
+    {
+        uint32_t states[BARPH_ANS_STATES];
+        ans_load_states(&t->ans, &r, states);
+        ans_unpack_symbols(&t->ans, states, &r, out, len);
+        out_buf->len = len;
+        return 0;
+    }
+    
+    huff_unpack_symbols(t, &r, out, len);
+    out_buf->len = len;
+    
+    return 0;
+}
+
+// threads
+// work is handed out one index at a time, so that uneven pieces of work don't leave threads idle
+
+typedef void (*barph_task_fn)(void * userdata, size_t index);
+
+typedef struct {
+    barph_task_fn task;
+    void * userdata;
+    size_t count;
+    size_t next;
+#ifndef BARPH_NO_THREADS
+    pthread_mutex_t lock;
+#endif
+} barph_pool_t;
+
+// seconds from some fixed point, for timing stages
+static double barph_now(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER freq, t;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&t);
+    return (double)t.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+#endif
+}
+
+static size_t barph_cpu_count(void)
+{
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+#else
+    return 1;
+#endif
+}
+
+#ifndef BARPH_NO_THREADS
+static void * barph_pool_worker(void * arg)
+{
+    barph_pool_t * pool = (barph_pool_t *)arg;
+    while (1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        size_t index = pool->next;
+        if (index < pool->count)
+            pool->next += 1;
+        pthread_mutex_unlock(&pool->lock);
+        
+        if (index >= pool->count)
+            return 0;
+        pool->task(pool->userdata, index);
+    }
+}
+#endif
+
+// calls task(userdata, i) for every i below count, across up to thread_count threads; 0 threads means one per core
+static void barph_parallel_for(size_t count, size_t thread_count, barph_task_fn task, void * userdata)
+{
+    if (thread_count == 0)
+        thread_count = barph_cpu_count();
+    if (thread_count > count)
+        thread_count = count;
+#ifndef BARPH_NO_THREADS
+    if (thread_count > 1)
+    {
+        barph_pool_t pool;
+        pool.task = task;
+        pool.userdata = userdata;
+        pool.count = count;
+        pool.next = 0;
+        pthread_mutex_init(&pool.lock, 0);
+        
+        // the calling thread is one of the workers; if a thread can't be started, the others pick up its share,
+        // and if there's no memory to keep track of them, the calling thread does it all
+        pthread_t * threads = (pthread_t *)BARPH_MALLOC(sizeof(pthread_t) * (thread_count - 1));
+        size_t started = 0;
+        for (size_t i = 0; threads && i + 1 < thread_count; i++)
+        {
+            if (pthread_create(&threads[started], 0, barph_pool_worker, &pool) == 0)
+                started += 1;
+        }
+        barph_pool_worker(&pool);
+        for (size_t i = 0; i < started; i++)
+            pthread_join(threads[i], 0);
+        
+        BARPH_FREE(threads);
+        pthread_mutex_destroy(&pool.lock);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < count; i++)
+        task(userdata, i);
+}
+
+// a single Huffman stream can be coded across threads too, with the same output: the data is cut into pieces, which are counted side by side,
+// and each piece's coded length in bits follows from its counts and the code, so every piece knows which bit it starts at before any are coded.
+// pieces are coded straight into the output, except that bits_write stores 8 bytes at a time, so the last BARPH_HUFF_TAIL_BITS or so of each
+// are coded into a small buffer instead, to keep it from writing over the start of the next piece. a piece can share its first byte with
+// the piece before and its last with the piece after, so those are put together once all of them are done
+#ifndef BARPH_HUFF_PIECE
+#define BARPH_HUFF_PIECE (1 << 20)
+#endif
+
+#define BARPH_HUFF_TAIL_BITS 128
+
+typedef struct {
+    const uint8_t * data;
+    size_t len;
+    huff_codes_t codes;
+    // 256 counts for each piece
+    uint64_t * counts;
+    // the bit each piece starts at in out, and where the last one ends
+    size_t * starts;
+    // the first and last byte of each piece, with only its own bits
+    uint8_t * edges;
+    uint8_t * out;
+} huff_pack_job_t;
+
+static void huff_pack_count_task(void * userdata, size_t index)
+{
+    huff_pack_job_t * job = (huff_pack_job_t *)userdata;
+    size_t start = index * BARPH_HUFF_PIECE;
+    size_t end = job->len - start < BARPH_HUFF_PIECE ? job->len : start + BARPH_HUFF_PIECE;
+    uint64_t * counts = &job->counts[index * 256];
+    for (size_t i = start; i < end; i += 1)
+        counts[job->data[i]] += 1;
+}
+
+static void huff_pack_code_task(void * userdata, size_t index)
+{
+    huff_pack_job_t * job = (huff_pack_job_t *)userdata;
+    size_t start = index * BARPH_HUFF_PIECE;
+    size_t end = job->len - start < BARPH_HUFF_PIECE ? job->len : start + BARPH_HUFF_PIECE;
+    size_t at = job->starts[index] / 8;
+    
+    size_t tail = end;
+    size_t tail_bits = 0;
+    while (tail > start && tail_bits < BARPH_HUFF_TAIL_BITS)
+    {
+        tail -= 1;
+        tail_bits += job->codes.lengths[job->data[tail]];
+    }
+    
+    bit_writer_t w;
+    memset(&w, 0, sizeof(bit_writer_t));
+    w.buffer.data = &job->out[at];
+    w.acc_bits = job->starts[index] % 8;
+    huff_pack_symbols(&w, &job->codes, &job->data[start], tail - start);
+    
+    // the tail is at most BARPH_HUFF_TAIL_BITS plus a 15-bit code and 7 bits left over from before it, and the last write stores 8 bytes past that
+    uint8_t tail_bytes[(BARPH_HUFF_TAIL_BITS + 15 + 7) / 8 + 8];
+    bit_writer_t t = w;
+    t.buffer.data = tail_bytes;
+    t.buffer.len = 0;
+    huff_pack_symbols(&t, &job->codes, &job->data[tail], end - tail);
+    bits_flush(&t);
+    
+    // byte i of the tail is byte w.buffer.len + i of the piece
+    size_t first = w.buffer.len ? 0 : 1;
+    job->edges[index * 2] = w.buffer.len ? job->out[at] : tail_bytes[0];
+    job->edges[index * 2 + 1] = tail_bytes[t.buffer.len - 1];
+    if (t.buffer.len > first + 1)
+        memcpy(&job->out[at + w.buffer.len + first], &tail_bytes[first], t.buffer.len - first - 1);
+}
+
+// like huff_pack, with the same output, but across thread_count threads (0 for one per core); only single streams (do_huff 1 and 2) are split
+static int huff_pack_threads(byte_buffer_t * out, const uint8_t * data, size_t len, uint8_t do_huff, size_t thread_count)
+{
+    size_t count = (len + BARPH_HUFF_PIECE - 1) / BARPH_HUFF_PIECE;
+    if (thread_count == 0)
+        thread_count = barph_cpu_count();
+    if (thread_count == 1 || count < 2 || (do_huff != 1 && do_huff != 2))
+        return huff_pack(out, data, len, do_huff);
+    
+    huff_pack_job_t job;
+    job.data = data;
+    job.len = len;
+    job.counts = (uint64_t *)BARPH_MALLOC(sizeof(uint64_t) * 256 * count);
+    job.starts = (size_t *)BARPH_MALLOC(sizeof(size_t) * (count + 1));
+    job.edges = (uint8_t *)BARPH_MALLOC(count * 2);
+    // without room to split it up, it's coded on this thread instead
+    if (!job.counts || !job.starts || !job.edges)
+    {
+        BARPH_FREE(job.edges);
+        BARPH_FREE(job.starts);
+        BARPH_FREE(job.counts);
+        return huff_pack(out, data, len, do_huff);
+    }
+    memset(job.counts, 0, sizeof(uint64_t) * 256 * count);
+    barph_parallel_for(count, thread_count, huff_pack_count_task, &job);
+    
+    uint64_t counts[256] = {0};
+    for (size_t k = 0; k < count; k++)
+    {
+        for (size_t b = 0; b < 256; b++)
+            counts[b] += job.counts[k * 256 + b];
+    }
+    bit_writer_t w;
+    if (huff_pack_header(&w, &job.codes, out, counts, len, do_huff) != 0)
+    {
+        BARPH_FREE(job.edges);
+        BARPH_FREE(job.starts);
+        BARPH_FREE(job.counts);
+        return -1;
+    }
+    
+    job.starts[0] = w.buffer.len * 8 + w.acc_bits;
+    for (size_t k = 0; k < count; k++)
+    {
+        size_t bits = 0;
+        for (size_t b = 0; b < 256; b++)
+            bits += job.counts[k * 256 + b] * job.codes.lengths[b];
+        job.starts[k + 1] = job.starts[k] + bits;
+    }
+    job.out = w.buffer.data;
+    // the first piece shares its first byte with the last bits of the code, which it writes over
+    uint8_t shared = w.buffer.data[w.buffer.len];
+    barph_parallel_for(count, thread_count, huff_pack_code_task, &job);
+    
+    // every piece is at least one bit long, so its first byte comes after the last byte of the piece before, or is the same byte
+    for (size_t k = 0; k < count; k++)
+    {
+        size_t at = job.starts[k] / 8;
+        size_t last = (job.starts[k + 1] - 1) / 8;
+        job.out[at] = (job.starts[k] % 8 ? shared : 0) | job.edges[k * 2];
+        if (last != at)
+            job.out[last] = job.edges[k * 2 + 1];
+        shared = job.out[last];
+    }
+    w.buffer.len = (job.starts[count] + 7) / 8;
+    *out = w.buffer;
+    
+    BARPH_FREE(job.edges);
+    BARPH_FREE(job.starts);
+    BARPH_FREE(job.counts);
+    return 0;
+}
+
+// header layout: "bRPH", flags, do_diff, do_rle, do_huff, checksum (4 bytes)
+#define BARPH_HEADER_SIZE 12
+
+// payload is a block container: block size (4 bytes), total length (8 bytes), then the offset of each block (8 bytes each), then the blocks
+// every block is an independent payload covering block size bytes of the input, with its own delta history, RLE stream and Huffman code
+#define BARPH_FLAG_BLOCKS 0x01
+// payload is a stream of frames: raw length (4 bytes), packed length (4 bytes), then an independent block like in a block container
+// a frame with a raw length of 0 ends the stream, and is followed by the checksum (4 bytes); the header's checksum is 0
+#define BARPH_FLAG_STREAM 0x02
+// the checksum is the block hash instead of the serial checksum: every block (or stream frame, or the whole payload when it's
+// a single block) gets its own barph_hash, and those are folded together in order, so blocks can be hashed in parallel
+#define BARPH_FLAG_HASH 0x04
+// the payload starts with the decompressed length (8 bytes); only for files that aren't block containers or streams
+#define BARPH_FLAG_SIZE 0x08
+// blocks of a block container or stream whose packed length is the same as their raw length are stored, skipping RLE and Huffman coding
+// (whole files are stored by setting do_rle and do_huff to 0 instead)
+#define BARPH_FLAG_STORED 0x10
+// every piece (the whole payload, or each block or frame) that goes through RLE or Huffman coding is split into byte planes first (see barph_compress_planes)
+#define BARPH_FLAG_PLANES 0x20
+#define BARPH_KNOWN_FLAGS (BARPH_FLAG_BLOCKS | BARPH_FLAG_STREAM | BARPH_FLAG_HASH | BARPH_FLAG_SIZE | BARPH_FLAG_STORED | BARPH_FLAG_PLANES)
+
+#ifndef BARPH_BLOCK_SIZE
+#define BARPH_BLOCK_SIZE (1 << 20)
+#endif
+
+#define BARPH_CHECKSUM_INIT 0x87654321
+
+// continues a checksum over data that starts `offset` bytes into the whole input
+static uint32_t barph_checksum_update(uint32_t checksum, const uint8_t * data, size_t len, size_t offset)
+{
+    const uint32_t big_prime = 0x1011B0D5;
+    
+    for (size_t i = 0; i < len; i += 1)
+        checksum = (checksum ^ data[i] ^ (offset + i)) * big_prime;
+    return checksum;
+}
+static uint32_t barph_checksum(const uint8_t * data, size_t len)
+{
+    return barph_checksum_update(BARPH_CHECKSUM_INIT, data, len, 0);
+}
+
+// block hash
+// four independent 64-bit lanes over 32-byte stripes, in the style of xxHash64, so it runs at about memory speed
+
+#define BARPH_HASH_P1 UINT64_C(0x9E3779B185EBCA87)
+#define BARPH_HASH_P2 UINT64_C(0xC2B2AE3D27D4EB4F)
+#define BARPH_HASH_P3 UINT64_C(0x165667B19E3779F9)
+#define BARPH_HASH_P4 UINT64_C(0x85EBCA77C2B2AE63)
+#define BARPH_HASH_P5 UINT64_C(0x27D4EB2F165667C5)
+
+static uint64_t barph_rotl64(uint64_t x, int n)
+{
+    return (x << n) | (x >> (64 - n));
+}
+static uint64_t barph_hash_round(uint64_t acc, uint64_t input)
+{
+    return barph_rotl64(acc + input * BARPH_HASH_P2, 31) * BARPH_HASH_P1;
+}
+static uint64_t barph_hash_merge(uint64_t h, uint64_t lane)
+{
+    return (h ^ barph_hash_round(0, lane)) * BARPH_HASH_P1 + BARPH_HASH_P4;
+}
+
+static uint64_t barph_hash(const uint8_t * data, size_t len)
+{
+    size_t i = 0;
+    uint64_t h;
+    if (len >= 32)
+    {
+        uint64_t v1 = BARPH_HASH_P1 + BARPH_HASH_P2;
+        uint64_t v2 = BARPH_HASH_P2;
+        uint64_t v3 = 0;
+        uint64_t v4 = 0 - BARPH_HASH_P1;
+        for (; i + 32 <= len; i += 32)
+        {
+            v1 = barph_hash_round(v1, load_u64le(&data[i]));
+            v2 = barph_hash_round(v2, load_u64le(&data[i + 8]));
+            v3 = barph_hash_round(v3, load_u64le(&data[i + 16]));
+            v4 = barph_hash_round(v4, load_u64le(&data[i + 24]));
+        }
+        h = barph_rotl64(v1, 1) + barph_rotl64(v2, 7) + barph_rotl64(v3, 12) + barph_rotl64(v4, 18);
+        h = barph_hash_merge(h, v1);
+        h = barph_hash_merge(h, v2);
+        h = barph_hash_merge(h, v3);
+        h = barph_hash_merge(h, v4);
+    }
+    else
+        h = BARPH_HASH_P5;
+    
+    h += len;
+    for (; i + 8 <= len; i += 8)
+        h = barph_rotl64(h ^ barph_hash_round(0, load_u64le(&data[i])), 27) * BARPH_HASH_P1 + BARPH_HASH_P4;
+    if (i + 4 <= len)
+    {
+        h = barph_rotl64(h ^ (load_u32le(&data[i]) * BARPH_HASH_P1), 23) * BARPH_HASH_P2 + BARPH_HASH_P3;
+        i += 4;
+    }
+    for (; i < len; i += 1)
+        h = barph_rotl64(h ^ (data[i] * BARPH_HASH_P5), 11) * BARPH_HASH_P1;
+    
+    h ^= h >> 33;
+    h *= BARPH_HASH_P2;
+    h ^= h >> 29;
+    h *= BARPH_HASH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+// block hashes are folded into a running state starting at BARPH_CHECKSUM_INIT, in block order, then cut down to the stored checksum
+static uint64_t barph_hash_fold(uint64_t state, uint64_t block_hash)
+{
+    return barph_rotl64(state ^ barph_hash_round(0, block_hash), 27) * BARPH_HASH_P1 + BARPH_HASH_P4;
+}
+static uint32_t barph_hash_final(uint64_t state)
+{
+    return (uint32_t)(state ^ (state >> 32));
+}
+
+// delta filter
+// each byte becomes the difference from the byte dist bytes before it; the first dist bytes are left as they are
+// the checksum is taken in the same pass when asked for, so the data is only read from memory once
+
+// delta codes data[start, len) in place, given the 8 original bytes before start (the newest in the top byte); dist is at most 8
+static void barph_delta_encode_scalar(uint8_t * data, size_t len, size_t start, size_t dist, uint64_t history, uint32_t * checksum, size_t offset)
+{
+    if (!checksum)
+    {
+        for (size_t i = start; i < len; i += 1)
+        {
+            uint8_t byte = data[i];
+            data[i] = byte - (uint8_t)(history >> (64 - 8 * dist));
+            history = (history >> 8) | ((uint64_t)byte << 56);
+        }
+        return;
+    }
+    const uint32_t big_prime = 0x1011B0D5;
+    uint32_t c = *checksum;
+    for (size_t i = start; i < len; i += 1)
+    {
+        uint8_t byte = data[i];
+        c = (c ^ byte ^ (offset + i)) * big_prime;
+        data[i] = byte - (uint8_t)(history >> (64 - 8 * dist));
+        history = (history >> 8) | ((uint64_t)byte << 56);
+    }
+    *checksum = c;
+}
+
+// undoes delta coding of data[start, len) in place; everything before start must already be decoded
+static void barph_delta_decode_scalar(uint8_t * data, size_t len, size_t start, size_t dist, uint32_t * checksum, size_t offset)
+{
+    // the first dist bytes of the whole input aren't delta coded
+    size_t i = start;
+    if (i < dist)
+        i = dist < len ? dist : len;
+    if (!checksum)
+    {
+        for (; i < len; i += 1)
+            data[i] += data[i - dist];
+        return;
+    }
+    const uint32_t big_prime = 0x1011B0D5;
+    uint32_t c = barph_checksum_update(*checksum, &data[start], i - start, offset + start);
+    for (; i < len; i += 1)
+    {
+        data[i] += data[i - dist];
+        c = (c ^ data[i] ^ (offset + i)) * big_prime;
+    }
+    *checksum = c;
+}
+
+#ifdef BARPH_SSE2
+// byte shifts by 16 or more would clear the whole register, but aren't valid immediates everywhere
+#define BARPH_SLLI_SI128(x, n) ((n) < 16 ? _mm_slli_si128(x, (n) < 16 ? (n) : 0) : _mm_setzero_si128())
+
+// each vector is the input minus the input shifted up by D bytes, with the bottom D bytes coming from the end of the previous vector
+#define BARPH_DELTA_ENCODE_SSE2(D) \
+static void barph_delta_encode_sse2_##D(uint8_t * data, size_t len, uint32_t * checksum, size_t offset) \
+{ \
+    uint32_t c = checksum ? *checksum : 0; \
+    __m128i prev = _mm_setzero_si128(); \
+    size_t i = 0; \
+    for (; i + 16 <= len; i += 16) \
+    { \
+        __m128i cur = _mm_loadu_si128((const __m128i *)&data[i]); \
+        if (checksum) \
+            c = barph_checksum_update(c, &data[i], 16, offset + i); \
+        __m128i before = _mm_or_si128(_mm_slli_si128(cur, D), _mm_srli_si128(prev, 16 - D)); \
+        _mm_storeu_si128((__m128i *)&data[i], _mm_sub_epi8(cur, before)); \
+        prev = cur; \
+    } \
+    uint8_t spill[16]; \
+    _mm_storeu_si128((__m128i *)spill, prev); \
+    barph_delta_encode_scalar(data, len, i, D, load_u64le(&spill[8]), checksum ? &c : 0, offset); \
+    if (checksum) \
+        *checksum = c; \
+}
+
+// a prefix sum with stride D inside each vector, plus the last D decoded bytes of the previous vector repeated across it
+// it picks up from the 16 bytes before start, so the first 16 bytes of the whole input are left to the scalar loop; dist is always D
+#define BARPH_DELTA_DECODE_SSE2(D) \
+static void barph_delta_decode_sse2_##D(uint8_t * data, size_t start, size_t len, size_t dist, uint32_t * checksum, size_t offset) \
+{ \
+    (void)dist; \
+    size_t i = start; \
+    if (i < 16) \
+    { \
+        i = len < 16 ? len : 16; \
+        barph_delta_decode_scalar(data, i, start, D, checksum, offset); \
+    } \
+    uint32_t c = checksum ? *checksum : 0; \
+    __m128i prev = i >= 16 ? _mm_loadu_si128((const __m128i *)&data[i - 16]) : _mm_setzero_si128(); \
+    for (; i + 16 <= len; i += 16) \
+    { \
+        __m128i x = _mm_loadu_si128((const __m128i *)&data[i]); \
+        x = _mm_add_epi8(x, BARPH_SLLI_SI128(x, D)); \
+        x = _mm_add_epi8(x, BARPH_SLLI_SI128(x, 2 * D)); \
+        x = _mm_add_epi8(x, BARPH_SLLI_SI128(x, 4 * D)); \
+        x = _mm_add_epi8(x, BARPH_SLLI_SI128(x, 8 * D)); \
+        __m128i carry = _mm_srli_si128(prev, 16 - D); \
+        carry = _mm_or_si128(carry, BARPH_SLLI_SI128(carry, D)); \
+        carry = _mm_or_si128(carry, BARPH_SLLI_SI128(carry, 2 * D)); \
+        carry = _mm_or_si128(carry, BARPH_SLLI_SI128(carry, 4 * D)); \
+        carry = _mm_or_si128(carry, BARPH_SLLI_SI128(carry, 8 * D)); \
+        x = _mm_add_epi8(x, carry); \
+        _mm_storeu_si128((__m128i *)&data[i], x); \
+        prev = x; \
+        if (checksum) \
+            c = barph_checksum_update(c, &data[i], 16, offset + i); \
+    } \
+    barph_delta_decode_scalar(data, len, i, D, checksum ? &c : 0, offset); \
+    if (checksum) \
+        *checksum = c; \
+}
+
+BARPH_DELTA_DECODE_SSE2(1)
+BARPH_DELTA_DECODE_SSE2(2)
+BARPH_DELTA_DECODE_SSE2(3)
+BARPH_DELTA_DECODE_SSE2(4)
+BARPH_DELTA_DECODE_SSE2(8)
+#define BARPH_DELTA_DECODE_KERNEL(D) barph_delta_decode_sse2_##D
+#endif
+
+#if defined(BARPH_AVX2)
+// like the SSE2 kernel, but the shifted input has to be put together across the two 128-bit lanes
+#define BARPH_DELTA_ENCODE_AVX2(D) \
+static void barph_delta_encode_avx2_##D(uint8_t * data, size_t len, uint32_t * checksum, size_t offset) \
+{ \
+    uint32_t c = checksum ? *checksum : 0; \
+    __m256i prev = _mm256_setzero_si256(); \
+    size_t i = 0; \
+    for (; i + 32 <= len; i += 32) \
+    { \
+        __m256i cur = _mm256_loadu_si256((const __m256i *)&data[i]); \
+        if (checksum) \
+            c = barph_checksum_update(c, &data[i], 32, offset + i); \
+        __m256i straddle = _mm256_permute2x128_si256(prev, cur, 0x21); \
+        __m256i before = _mm256_alignr_epi8(cur, straddle, 16 - D); \
+        _mm256_storeu_si256((__m256i *)&data[i], _mm256_sub_epi8(cur, before)); \
+        prev = cur; \
+    } \
+    uint8_t spill[32]; \
+    _mm256_storeu_si256((__m256i *)spill, prev); \
+    barph_delta_encode_scalar(data, len, i, D, load_u64le(&spill[24]), checksum ? &c : 0, offset); \
+    if (checksum) \
+        *checksum = c; \
+}
+
+BARPH_DELTA_ENCODE_AVX2(1)
+BARPH_DELTA_ENCODE_AVX2(2)
+BARPH_DELTA_ENCODE_AVX2(3)
+BARPH_DELTA_ENCODE_AVX2(4)
+BARPH_DELTA_ENCODE_AVX2(8)
+#define BARPH_DELTA_ENCODE_KERNEL(D) barph_delta_encode_avx2_##D
+#elif defined(BARPH_SSE2)
+BARPH_DELTA_ENCODE_SSE2(1)
+BARPH_DELTA_ENCODE_SSE2(2)
+BARPH_DELTA_ENCODE_SSE2(3)
+BARPH_DELTA_ENCODE_SSE2(4)
+BARPH_DELTA_ENCODE_SSE2(8)
+#define BARPH_DELTA_ENCODE_KERNEL(D) barph_delta_encode_sse2_##D
+#endif
+
+// if checksum isn't null, it's continued over the original data, which starts `offset` bytes into the whole input
+static void barph_delta_encode(uint8_t * data, size_t len, uint8_t dist, uint32_t * checksum, size_t offset)
+{
+#ifdef BARPH_DELTA_ENCODE_KERNEL
+    switch (dist)
+    {
+    case 1: BARPH_DELTA_ENCODE_KERNEL(1)(data, len, checksum, offset); return;
+    case 2: BARPH_DELTA_ENCODE_KERNEL(2)(data, len, checksum, offset); return;
+    case 3: BARPH_DELTA_ENCODE_KERNEL(3)(data, len, checksum, offset); return;
+    case 4: BARPH_DELTA_ENCODE_KERNEL(4)(data, len, checksum, offset); return;
+    case 8: BARPH_DELTA_ENCODE_KERNEL(8)(data, len, checksum, offset); return;
+    }
+#endif
+    if (dist > 0 && dist <= 8)
+    {
+        barph_delta_encode_scalar(data, len, 0, dist, 0, checksum, offset);
+        return;
+    }
+    if (checksum)
+        *checksum = barph_checksum_update(*checksum, data, len, offset);
+    if (dist)
+    {
+        for (size_t i = len; i > dist; i -= 1)
+            data[i - 1] -= data[i - 1 - dist];
+    }
+}
+
+// undoes delta coding of data[start, len) like barph_delta_decode_scalar, with the distance's own kernel if it has one
+// these are picked once per input with barph_delta_decoder, then run over it a piece at a time
+typedef void (*barph_delta_fn)(uint8_t * data, size_t start, size_t len, size_t dist, uint32_t * checksum, size_t offset);
+
+static void barph_delta_decode_any(uint8_t * data, size_t start, size_t len, size_t dist, uint32_t * checksum, size_t offset)
+{
+    if (dist)
+        barph_delta_decode_scalar(data, len, start, dist, checksum, offset);
+    else if (checksum)
+        *checksum = barph_checksum_update(*checksum, &data[start], len - start, offset + start);
+}
+
+static barph_delta_fn barph_delta_decoder(uint8_t dist)
+{
+#ifdef BARPH_DELTA_DECODE_KERNEL
+    switch (dist)
+    {
+    case 1: return BARPH_DELTA_DECODE_KERNEL(1);
+    case 2: return BARPH_DELTA_DECODE_KERNEL(2);
+    case 3: return BARPH_DELTA_DECODE_KERNEL(3);
+    case 4: return BARPH_DELTA_DECODE_KERNEL(4);
+    case 8: return BARPH_DELTA_DECODE_KERNEL(8);
+    }
+#endif
+    (void)dist;
+    return barph_delta_decode_any;
+}
+
+// undoes barph_delta_encode; if checksum isn't null, it's continued over the decoded data
+BARPH_API void barph_delta_decode(uint8_t * data, size_t len, uint8_t dist, uint32_t * checksum, size_t offset)
+{
+    barph_delta_decoder(dist)(data, 0, len, dist, checksum, offset);
+}
+
+// pre-shared dictionaries
+// a dictionary is a Huffman code trained ahead of time on sample data, and known to both sides, so small payloads don't pay for storing
+// their own code, and data can be coded in one pass, without counting it first
+// its ID is a hash of the code, so data is never decoded with the wrong dictionary; dictionaries are stored as "bRPD", the ID, and the code lengths
+
+typedef struct {
+    uint32_t id;
+    huff_codes_t codes;
+    huff_table_t table;
+} barph_dict_t;
+
+// sets up a dictionary from its code lengths; returns nonzero if they don't describe a complete code
+static int barph_dict_init(barph_dict_t * dict, const uint8_t * lengths)
+{
+    if (huff_build_codes(&dict->codes, lengths) != 0)
+        return -1;
+    dict->id = (uint32_t)barph_hash(lengths, 256);
+    huff_tree_from_codes(&dict->table.tree, &dict->codes);
+    huff_table_build(&dict->table);
+    return 0;
+}
+
+// builds a dictionary from byte counts, as gathered by barph_dict_count; every byte gets a code, even ones the samples never had
+BARPH_API void barph_dict_build(barph_dict_t * dict, const uint64_t * counts)
+{
+    uint64_t smoothed[256];
+    for (size_t b = 0; b < 256; b++)
+        smoothed[b] = counts[b] + 1;
+    uint8_t lengths[256];
+    huff_build_lengths(smoothed, lengths);
+    barph_dict_init(dict, lengths);
+}
+
+// appends the dictionary to out; returns nonzero if it runs out of memory
+BARPH_API int barph_dict_save(const barph_dict_t * dict, byte_buffer_t * out)
+{
+    if (bytes_push(out, (const uint8_t *)"bRPD", 4) != 0 || bytes_push_u32(out, dict->id) != 0)
+        return -1;
+    
+    bit_writer_t w;
+    memset(&w, 0, sizeof(bit_writer_t));
+    w.buffer = *out;
+    if (bits_reserve(&w, 256 * 8) != 0)
+        return -1;
+    push_huff_lengths(&w, dict->codes.lengths);
+    bits_flush(&w);
+    *out = w.buffer;
+    return 0;
+}
+
+// returns nonzero if the data isn't a valid dictionary
+BARPH_API int barph_dict_load(barph_dict_t * dict, const uint8_t * data, size_t len)
+{
+    if (len < 8 || memcmp(data, "bRPD", 4) != 0)
+        return -1;
+    bit_reader_t r = {&data[8], len - 8, 0, 0, 0};
+    uint8_t lengths[256];
+    if (pop_huff_lengths(lengths, &r) != 0 || barph_dict_init(dict, lengths) != 0)
+        return -1;
+    return dict->id == load_u32le(&data[4]) ? 0 : -1;
+}
+
+// appends to out; the dictionary's ID and the length come first, then a single stream. returns nonzero if it runs out of memory
+static int huff_pack_dict(byte_buffer_t * out, const barph_dict_t * dict, const uint8_t * data, size_t len)
+{
+    bit_writer_t w;
+    memset(&w, 0, sizeof(bit_writer_t));
+    w.buffer = *out;
+    int failed = bytes_push_u32(&w.buffer, dict->id) | bytes_push_varint(&w.buffer, len);
+    
+    // without counting first, the output size isn't known, so room is made a piece at a time
+    for (size_t i = 0; i < len && !failed; i += 4096)
+    {
+        size_t n = len - i < 4096 ? len - i : 4096;
+        failed = bits_reserve(&w, n * BARPH_HUFF_MAX_BITS);
+        if (!failed)
+            huff_pack_symbols(&w, &dict->codes, &data[i], n);
+    }
+    if (!failed)
+        bits_flush(&w);
+    
+    *out = w.buffer;
+    return failed;
+}
+
+// reads the ID and length at the start of dictionary-coded data, and sets r to the first symbol;
+// returns nonzero if the data is malformed, has more than max symbols or was coded with a different dictionary
+static int huff_unpack_dict_header(const barph_dict_t * dict, const uint8_t * data, size_t data_len, bit_reader_t * r, size_t * len, uint64_t max)
+{
+    size_t pos = 4;
+    uint64_t n;
+    if (!dict || data_len < 4 || load_u32le(data) != dict->id || load_varint(data, data_len, &pos, &n) != 0)
+        return -1;
+    // every symbol takes at least one bit
+    if (n > max || n / 8 > data_len - pos)
+        return -1;
+    bit_reader_t start = {&data[pos], data_len - pos, 0, 0, 0};
+    *r = start;
+    *len = n;
+    return 0;
+}
+
+// replaces the contents of out, reusing its memory; returns nonzero if the data is malformed, has more than max symbols or was coded with a different dictionary
+static int huff_unpack_dict(byte_buffer_t * out_buf, const barph_dict_t * dict, const uint8_t * data, size_t data_len, uint64_t max)
+{
+    out_buf->len = 0;
+    bit_reader_t r;
+    size_t len;
+    if (huff_unpack_dict_header(dict, data, data_len, &r, &len, max) != 0)
+        return -1;
+    
+    // one byte of slack, for two-symbol entries that decode past the end
+    if (bytes_reserve(out_buf, len + 1) != 0)
+        return -1;
+    huff_unpack_symbols(&dict->table, &r, out_buf->data, len);
+    out_buf->len = len;
+    return 0;
+}
+
+// returns nonzero if it runs out of memory
+static int barph_push_header(byte_buffer_t * buf, uint8_t flags, uint8_t do_rle, uint8_t do_huff, uint8_t do_diff, uint32_t checksum)
+{
+    uint8_t header[BARPH_HEADER_SIZE] = {'b', 'R', 'P', 'H', flags, do_diff, do_rle, do_huff};
+    store_u32le(&header[8], checksum);
+    return bytes_push(buf, header, BARPH_HEADER_SIZE);
+}
+
+// stats
+// filled in when a context has a stats struct; otherwise the only cost is one check per stage
+
+#define BARPH_STAGE_DELTA 0
+#define BARPH_STAGE_RLE 1
+#define BARPH_STAGE_HUFF 2
+#define BARPH_STAGE_HASH 3
+#define BARPH_STAGE_COUNT 4
+
+#define BARPH_STATS_BUCKETS 16
+
+// the number of scratch buffers in barph_ctx_t; the last two are only used for byte planes
+#define BARPH_SCRATCH_COUNT 4
+
+typedef struct {
+    double seconds;
+    uint64_t in_bytes;
+    uint64_t out_bytes;
+} barph_stage_stats_t;
+
+// everything adds up over calls, so one struct can cover many payloads or stream frames; zero it before first use
+// the delta stage includes the serial checksum, which is taken in the same pass
+// allocations and peak bytes cover the context's scratch buffers and the output, as seen between stages: growing a buffer counts once per stage
+typedef struct {
+    barph_stage_stats_t stages[BARPH_STAGE_COUNT];
+    // the whole call, including anything outside the stages
+    double seconds;
+    // RLE runs and literals by how many bytes they stand for: bucket k counts lengths from 2^k to 2^(k+1) - 1
+    uint64_t rle_runs[BARPH_STATS_BUCKETS];
+    uint64_t rle_literals[BARPH_STATS_BUCKETS];
+    // the longest code, and the Huffman stage's symbols and output bits (including stored codes), for the average code length
+    uint8_t huff_max_bits;
+    uint64_t huff_symbols;
+    uint64_t huff_bits;
+    uint64_t allocs;
+    uint64_t peak_bytes;
+    // scratch buffer capacities when last looked at
+    size_t seen_cap[BARPH_SCRATCH_COUNT];
+} barph_stats_t;
+
+static size_t barph_stats_bucket(size_t n)
+{
+    size_t k = 0;
+    while (n > 1 && k + 1 < BARPH_STATS_BUCKETS)
+    {
+        n >>= 1;
+        k += 1;
+    }
+    return k;
+}
+
+// tallies the runs and literals of RLE data, as made by super_big_rle_compress
+static void barph_stats_rle(barph_stats_t * stats, const uint8_t * input, size_t input_len)
+{
+    size_t i = 8;
+    while (i < input_len)
+    {
+        uint8_t dat = input[i++];
+        if ((dat & 0xC0) == 0xC0)
+        {
+            if (i >= input_len)
+                return;
+            size_t size = (dat & 0x3F) | ((size_t)input[i++] << 6);
+            stats->rle_literals[barph_stats_bucket(size)] += 1;
+            i += size;
+        }
+        else if (!(dat & 0x80))
+        {
+            stats->rle_runs[barph_stats_bucket((dat & 0x7F) + 1)] += 1;
+            i += 1;
+        }
+        else
+        {
+            if (i >= input_len)
+                return;
+            size_t rle_size = input[i++] + 2;
+            stats->rle_runs[barph_stats_bucket(((dat & 0x7F) + 1) * rle_size)] += 1;
+            i += rle_size;
+        }
+    }
+}
+
+// notes the code of Huffman-coded data, which decoded to len bytes
+static void barph_stats_huff(barph_stats_t * stats, const uint8_t * packed, size_t packed_len, size_t len, uint8_t do_huff, const barph_dict_t * dict)
+{
+    uint8_t max_bits = 0;
+    if (do_huff == BARPH_HUFF_DICT)
+    {
+        for (size_t b = 0; dict && b < 256; b++)
+            max_bits = dict->codes.lengths[b] > max_bits ? dict->codes.lengths[b] : max_bits;
+    }
+    else
+    {
+        bit_reader_t r = {packed, packed_len, 0, 0, 0};
+        bits_read(&r, 32);
+        bits_read(&r, 32);
+        if (do_huff == 1)
+        {
+            huff_tree_t tree;
+            tree.node_count = 0;
+            if (huff_tree_pop(&tree, &r) >= 0)
+                max_bits = huff_tree_depth(&tree, 0);
+        }
+        // tANS has no codes, but the rarest byte takes the most bits
+        else if (do_huff == BARPH_HUFF_ANS)
+        {
+            unsigned log;
+            uint16_t freqs[256];
+            if (pop_ans_freqs(&log, freqs, &r) == 0)
+            {
+                for (size_t b = 0; b < 256; b++)
+                {
+                    if (freqs[b] && log - barph_top_bit64(freqs[b]) > max_bits)
+                        max_bits = log - barph_top_bit64(freqs[b]);
+                }
+            }
+        }
+        else
+        {
+            uint8_t lengths[256];
+            if (pop_huff_lengths(lengths, &r) == 0)
+            {
+                for (size_t b = 0; b < 256; b++)
+                    max_bits = lengths[b] > max_bits ? lengths[b] : max_bits;
+            }
+        }
+    }
+    if (max_bits > stats->huff_max_bits)
+        stats->huff_max_bits = max_bits;
+    stats->huff_symbols += len;
+    stats->huff_bits += (uint64_t)packed_len * 8;
+}
+
+// reusable state for compressing and decompressing many payloads: the scratch buffers keep their memory between calls,
+// so once they've grown to fit, calls of a similar size don't allocate at all
+// dict is the dictionary for do_huff 4, and stats is filled in if it isn't null; either can be set by the caller after barph_ctx_init,
+// and neither is owned by the context. lz_window is how far back do_rle 2 reaches when compressing, planes is the sample size to split
+// data into byte planes by when compressing (0 or 1 for none), and threads is how many threads a single Huffman stream is coded across
+// (1 by default, or 0 for one per core), which doesn't change the output; all three can be changed the same way
+typedef struct {
+    byte_buffer_t scratch[BARPH_SCRATCH_COUNT];
+    huff_table_t table;
+    const barph_dict_t * dict;
+    barph_stats_t * stats;
+    size_t lz_window;
+    size_t planes;
+    size_t threads;
+} barph_ctx_t;
+
+BARPH_API void barph_ctx_init(barph_ctx_t * ctx)
+{
+    memset(ctx->scratch, 0, sizeof(ctx->scratch));
+    ctx->dict = 0;
+    ctx->stats = 0;
+    ctx->lz_window = BARPH_LZ_WINDOW;
+    ctx->planes = 0;
+    ctx->threads = 1;
+}
+BARPH_API void barph_ctx_free(barph_ctx_t * ctx)
+{
+    for (size_t k = 0; k < BARPH_SCRATCH_COUNT; k++)
+        BARPH_FREE(ctx->scratch[k].data);
+    memset(ctx->scratch, 0, sizeof(ctx->scratch));
+}
+// hands a result over to the caller, taking it out of the context if it's one of the scratch buffers, or copying it otherwise;
+// the copy's data is null if it runs out of memory
+static byte_buffer_t barph_ctx_take(barph_ctx_t * ctx, byte_buffer_t result)
+{
+    for (size_t k = 0; k < BARPH_SCRATCH_COUNT; k++)
+    {
+        if (result.data && result.data == ctx->scratch[k].data)
+        {
+            memset(&ctx->scratch[k], 0, sizeof(byte_buffer_t));
+            return result;
+        }
+    }
+    byte_buffer_t copy = {0, 0, 0, 0};
+    bytes_push(&copy, result.data, result.len);
+    return copy;
+}
+
+// adds a finished stage to the context's stats, and returns the time, for the start of the next stage
+static double barph_stats_stage(barph_ctx_t * ctx, size_t stage, double start, size_t in_len, size_t out_len)
+{
+    barph_stats_t * stats = ctx->stats;
+    double now = barph_now();
+    stats->stages[stage].seconds += now - start;
+    stats->stages[stage].in_bytes += in_len;
+    stats->stages[stage].out_bytes += out_len;
+    
+    // buffers only grow while they're in the context, so a different capacity means an allocation
+    size_t held = 0;
+    for (size_t k = 0; k < BARPH_SCRATCH_COUNT; k++)
+    {
+        if (ctx->scratch[k].cap != stats->seen_cap[k])
+        {
+            stats->allocs += 1;
+            stats->seen_cap[k] = ctx->scratch[k].cap;
+        }
+        held += ctx->scratch[k].cap;
+    }
+    if (held > stats->peak_bytes)
+        stats->peak_bytes = held;
+    return now;
+}
+
+// stored blocks
+// data that RLE and Huffman coding can't shrink, like already-compressed data, skips both of them, both ways, and is kept as it is after delta coding
+// that's guessed from a sample before the stages run, so that such data doesn't go through them at all, and caught after them if the guess was wrong
+
+// the sample is a chunk of this many bytes out of every BARPH_STORED_STRIDE
+#define BARPH_STORED_CHUNK 256
+#define BARPH_STORED_STRIDE 4096
+
+// roughly the number of bits the Huffman stage would spend on data with the given byte counts, not counting the stored code:
+// each byte costs about log2(total / count) bits, but a code is never shorter than one bit
+// small samples look more predictable than the data they come from, so about 0.72 bits per used byte value are added back (Miller-Madow)
+static uint64_t huff_estimate_bits(const uint64_t * counts)
+{
+    uint64_t total = 0;
+    for (size_t b = 0; b < 256; b++)
+        total += counts[b];
+    if (!total)
+        return 0;
+    uint32_t log_total = barph_log2_fixed(total);
+    uint64_t bits = 0;
+    for (size_t b = 0; b < 256; b++)
+    {
+        if (!counts[b])
+            continue;
+        uint32_t cost = log_total - barph_log2_fixed(counts[b]);
+        bits += counts[b] * (cost < 256 ? 256 : cost) + 185;
+    }
+    return bits / 256;
+}
+
+// whether RLE and Huffman coding look like they'd gain less than a 64th on data: the sample's byte counts are close to even, and hardly any of it starts a run
+static int barph_looks_stored(const uint8_t * data, size_t len)
+{
+    uint64_t counts[256] = {0};
+    size_t sampled = 0;
+    for (size_t start = 0; start < len; start += BARPH_STORED_STRIDE)
+    {
+        size_t n = len - start < BARPH_STORED_CHUNK ? len - start : BARPH_STORED_CHUNK;
+        for (size_t i = 0; i < n; i++)
+            counts[data[start + i]] += 1;
+        sampled += n;
+    }
+    if (huff_estimate_bits(counts) < sampled * 8 - sampled / 8)
+        return 0;
+    
+    // random data has a run about every 32 KiB
+    size_t runs = 0;
+    for (size_t start = 0; start < len && runs <= sampled / 1024; start += BARPH_STORED_STRIDE)
+    {
+        size_t n = len - start < BARPH_STORED_CHUNK ? len - start : BARPH_STORED_CHUNK;
+        for (size_t p = find_efficient_rle(&data[start], n, 0, n); p < n; p = find_efficient_rle(&data[start], n, p + 1, n))
+            runs += 1;
+    }
+    return runs <= sampled / 1024;
+}
+
+// byte planes
+// samples of several bytes, like 16-bit audio or RGBA pixels, are split into one plane per byte of the sample, which go through the RLE and Huffman
+// stages on their own, each with its own code, so that high and low bytes don't share one. with BARPH_FLAG_PLANES, each piece that has those stages
+// starts with the number of planes, its length as a varint, and the compressed length of every plane but the last as varints, and then has the planes
+// in order. a plane whose compressed length is its raw length is stored. delta coding comes before the split, so a delta distance of the sample size
+// is delta coding within each plane
+
+#define BARPH_MAX_PLANES 16
+
+// the length of plane j of len bytes split into k planes
+static size_t barph_plane_len(size_t len, size_t k, size_t j)
+{
+    return len / k + (j < len % k);
+}
+
+// writes plane j of data, for every j, one after the other into out; the first `done` samples are already written
+static void barph_planes_split_scalar(uint8_t * out, const uint8_t * data, size_t len, size_t k, size_t done)
+{
+    for (size_t j = 0; j < k; j++)
+    {
+        for (size_t n = done; n * k + j < len; n++)
+            out[n] = data[n * k + j];
+        out += barph_plane_len(len, k, j);
+    }
+}
+
+// undoes barph_planes_split_scalar
+static void barph_planes_join_scalar(uint8_t * out, const uint8_t * planes, size_t len, size_t k, size_t done)
+{
+    for (size_t j = 0; j < k; j++)
+    {
+        for (size_t n = done; n * k + j < len; n++)
+            out[n * k + j] = planes[n];
+        planes += barph_plane_len(len, k, j);
+    }
+}
+
+#if defined(BARPH_SSE2)
+// splits 16 samples of two bytes each into their even and odd bytes
+static void barph_split_pairs_sse2(__m128i a, __m128i b, __m128i * even, __m128i * odd)
+{
+    const __m128i low = _mm_set1_epi16(0x00FF);
+    *even = _mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low));
+    *odd = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+}
+#endif
+
+// splits data into k planes, one after the other, in out; samples of 2 and 4 bytes are split 16 at a time with SSE2
+static void barph_planes_split(uint8_t * out, const uint8_t * data, size_t len, size_t k)
+{
+    size_t done = 0;
+#if defined(BARPH_SSE2)
+    size_t samples = len / k;
+    if (k == 2)
+    {
+        uint8_t * p1 = &out[barph_plane_len(len, 2, 0)];
+        for (; done + 16 <= samples; done += 16)
+        {
+            __m128i p[2];
+            barph_split_pairs_sse2(_mm_loadu_si128((const __m128i *)&data[done * 2]), _mm_loadu_si128((const __m128i *)&data[done * 2 + 16]), &p[0], &p[1]);
+            _mm_storeu_si128((__m128i *)&out[done], p[0]);
+            _mm_storeu_si128((__m128i *)&p1[done], p[1]);
+        }
+    }
+    else if (k == 4)
+    {
+        uint8_t * p[4];
+        for (size_t j = 0; j < 4; j++)
+            p[j] = j ? p[j - 1] + barph_plane_len(len, 4, j - 1) : out;
+        for (; done + 16 <= samples; done += 16)
+        {
+            // bytes 0 and 2 of each sample, then bytes 1 and 3, and then each of those split again
+            __m128i even[2], odd[2], bytes[4];
+            const uint8_t * s = &data[done * 4];
+            barph_split_pairs_sse2(_mm_loadu_si128((const __m128i *)s), _mm_loadu_si128((const __m128i *)&s[16]), &even[0], &odd[0]);
+            barph_split_pairs_sse2(_mm_loadu_si128((const __m128i *)&s[32]), _mm_loadu_si128((const __m128i *)&s[48]), &even[1], &odd[1]);
+            barph_split_pairs_sse2(even[0], even[1], &bytes[0], &bytes[2]);
+            barph_split_pairs_sse2(odd[0], odd[1], &bytes[1], &bytes[3]);
+            for (size_t j = 0; j < 4; j++)
+                _mm_storeu_si128((__m128i *)&p[j][done], bytes[j]);
+        }
+    }
+#endif
+    barph_planes_split_scalar(out, data, len, k, done);
+}
+
+// undoes barph_planes_split
+static void barph_planes_join(uint8_t * out, const uint8_t * planes, size_t len, size_t k)
+{
+    size_t done = 0;
+#if defined(BARPH_SSE2)
+    size_t samples = len / k;
+    if (k == 2)
+    {
+        const uint8_t * p1 = &planes[barph_plane_len(len, 2, 0)];
+        for (; done + 16 <= samples; done += 16)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i *)&planes[done]);
+            __m128i b = _mm_loadu_si128((const __m128i *)&p1[done]);
+            _mm_storeu_si128((__m128i *)&out[done * 2], _mm_unpacklo_epi8(a, b));
+            _mm_storeu_si128((__m128i *)&out[done * 2 + 16], _mm_unpackhi_epi8(a, b));
+        }
+    }
+    else if (k == 4)
+    {
+        const uint8_t * p[4];
+        for (size_t j = 0; j < 4; j++)
+            p[j] = j ? p[j - 1] + barph_plane_len(len, 4, j - 1) : planes;
+        for (; done + 16 <= samples; done += 16)
+        {
+            __m128i bytes[4];
+            for (size_t j = 0; j < 4; j++)
+                bytes[j] = _mm_loadu_si128((const __m128i *)&p[j][done]);
+            // bytes 0 and 1 of each sample side by side, and bytes 2 and 3, and then those pairs side by side
+            __m128i lo01 = _mm_unpacklo_epi8(bytes[0], bytes[1]);
+            __m128i hi01 = _mm_unpackhi_epi8(bytes[0], bytes[1]);
+            __m128i lo23 = _mm_unpacklo_epi8(bytes[2], bytes[3]);
+            __m128i hi23 = _mm_unpackhi_epi8(bytes[2], bytes[3]);
+            uint8_t * d = &out[done * 4];
+            _mm_storeu_si128((__m128i *)d, _mm_unpacklo_epi16(lo01, lo23));
+            _mm_storeu_si128((__m128i *)&d[16], _mm_unpackhi_epi16(lo01, lo23));
+            _mm_storeu_si128((__m128i *)&d[32], _mm_unpacklo_epi16(hi01, hi23));
+            _mm_storeu_si128((__m128i *)&d[48], _mm_unpackhi_epi16(hi01, hi23));
+        }
+    }
+#endif
+    barph_planes_join_scalar(out, planes, len, k, done);
+}
+
+// runs the RLE and Huffman stages over data, like barph_compress_stages does after delta coding, with the same results
+// start is when the stage before them finished, for stats
+static int barph_compress_entropy(barph_ctx_t * ctx, uint8_t * data, size_t len, uint8_t do_rle, uint8_t do_huff, byte_buffer_t * out, double start, byte_buffer_t * result)
+{
+    byte_buffer_t buf = {data, len, len, 0};
+    size_t out_start = out ? out->len : 0;
+    
+    // the sample only sees byte counts and runs, not repeats from further back, so with LZ77 it's left to the size check at the end
+    if ((do_rle || do_huff) && do_rle != BARPH_RLE_LZ && barph_looks_stored(buf.data, buf.len))
+    {
+        do_rle = 0;
+        do_huff = 0;
+    }
+    if (do_rle)
+    {
+        byte_buffer_t * rle = (out && !do_huff) ? out : &ctx->scratch[0];
+        size_t at = rle == out ? out->len : 0;
+        rle->len = at;
+        // LZ77's hash chains go in the other scratch buffer, which the Huffman stage only needs afterwards
+        if (barph_rle_compress(rle, &ctx->scratch[1], buf.data, buf.len, do_rle, ctx->lz_window) != 0)
+        {
+            rle->len = at;
+            return -1;
+        }
+        byte_buffer_t view = {&rle->data[at], rle->len - at, rle->cap - at, 0};
+        if (ctx->stats)
+        {
+            if (do_rle != BARPH_RLE_LZ)
+                barph_stats_rle(ctx->stats, view.data, view.len);
+            start = barph_stats_stage(ctx, BARPH_STAGE_RLE, start, buf.len, view.len);
+        }
+        buf = view;
+    }
+    if (do_huff)
+    {
+        byte_buffer_t * packed = out ? out : &ctx->scratch[1];
+        size_t at = out ? out->len : 0;
+        packed->len = at;
+        int failed = do_huff == BARPH_HUFF_DICT ? huff_pack_dict(packed, ctx->dict, buf.data, buf.len)
+            : huff_pack_threads(packed, buf.data, buf.len, do_huff, ctx->threads);
+        if (failed)
+        {
+            packed->len = at;
+            return -1;
+        }
+        byte_buffer_t view = {&packed->data[at], packed->len - at, packed->cap - at, 0};
+        if (ctx->stats)
+        {
+            barph_stats_huff(ctx->stats, view.data, view.len, buf.len, do_huff, ctx->dict);
+            barph_stats_stage(ctx, BARPH_STAGE_HUFF, start, buf.len, view.len);
+        }
+        buf = view;
+    }
+    // the sample missed that the stages wouldn't gain anything, so the data is stored after all
+    if ((do_rle || do_huff) && buf.len >= len)
+    {
+        if (out)
+            out->len = out_start;
+        buf.data = data;
+        buf.len = len;
+        do_rle = 0;
+        do_huff = 0;
+    }
+    if (out && !do_rle && !do_huff)
+    {
+        if (bytes_push(out, buf.data, buf.len) != 0)
+            return -1;
+        buf.data = &out->data[out->len - buf.len];
+    }
+    *result = buf;
+    return 0;
+}
+
+// splits data into ctx->planes planes and runs the RLE and Huffman stages over each of them, with the same results as barph_compress_entropy
+static int barph_compress_planes(barph_ctx_t * ctx, uint8_t * data, size_t len, uint8_t do_rle, uint8_t do_huff, byte_buffer_t * out, byte_buffer_t * result)
+{
+    size_t k = ctx->planes;
+    byte_buffer_t * planes = &ctx->scratch[2];
+    planes->len = 0;
+    if (bytes_reserve(planes, len) != 0)
+        return -1;
+    barph_planes_split(planes->data, data, len, k);
+    
+    // the planes go after whatever's in out, or into the last scratch buffer, since the stages use the first two
+    byte_buffer_t * packed = out ? out : &ctx->scratch[3];
+    size_t at = out ? out->len : 0;
+    packed->len = at;
+    uint64_t packed_lens[BARPH_MAX_PLANES];
+    size_t plane_start = 0;
+    for (size_t j = 0; j < k; j++)
+    {
+        size_t n = barph_plane_len(len, k, j);
+        byte_buffer_t plane;
+        if (barph_compress_entropy(ctx, &planes->data[plane_start], n, do_rle, do_huff, packed, ctx->stats ? barph_now() : 0, &plane) != 0)
+        {
+            packed->len = at;
+            return -1;
+        }
+        packed_lens[j] = plane.len;
+        plane_start += n;
+    }
+    
+    // the lengths go in front, once they're known; the split planes aren't needed anymore, so they're built where those were
+    planes->len = 0;
+    int failed = byte_push(planes, (uint8_t)k) | bytes_push_varint(planes, len);
+    for (size_t j = 0; j + 1 < k; j++)
+        failed |= bytes_push_varint(planes, packed_lens[j]);
+    if (failed)
+    {
+        packed->len = at;
+        return -1;
+    }
+    size_t body_len = packed->len - at;
+    // the lengths can make it not worth it after all, and then the piece is stored whole
+    if (planes->len + body_len >= len)
+    {
+        packed->len = at;
+        if (!out)
+        {
+            byte_buffer_t stored = {data, len, len, 0};
+            *result = stored;
+            return 0;
+        }
+        if (bytes_push(out, data, len) != 0)
+            return -1;
+        byte_buffer_t stored = {&out->data[at], len, len, 0};
+        *result = stored;
+        return 0;
+    }
+    if (bytes_reserve(packed, planes->len) != 0)
+    {
+        packed->len = at;
+        return -1;
+    }
+    memmove(&packed->data[at + planes->len], &packed->data[at], body_len);
+    memcpy(&packed->data[at], planes->data, planes->len);
+    packed->len += planes->len;
+    byte_buffer_t view = {&packed->data[at], packed->len - at, packed->cap - at, 0};
+    *result = view;
+    return 0;
+}
+
+// the header flags that compressing with ctx's settings needs
+static uint8_t barph_ctx_flags(const barph_ctx_t * ctx)
+{
+    return (ctx->planes > 1 && ctx->planes <= BARPH_MAX_PLANES) ? BARPH_FLAG_PLANES : 0;
+}
+
+// runs the delta, RLE and Huffman stages over one independent piece of data, splitting it into byte planes first if ctx->planes is more than 1
+// delta coding modifies the data in place; if out isn't null, the last stage appends straight to it, and otherwise
+// the result is one of the context's scratch buffers, or the data itself if there are no other stages
+// data that RLE and Huffman coding wouldn't shrink is stored, as if there were no other stages; then, and only then, the result is as long as the data
+// if checksum isn't null, it's continued over the data, which starts `offset` bytes into the whole input
+// returns nonzero if it runs out of memory, and then out is left as it was
+// unlike decoding, this has no specialized pipelines: each stage is a single pass over all of the data with its own loop, so the flags are only
+// checked once per stage, and the Huffman stage has to count everything before it codes anything, so the stages can't share a window
+static int barph_compress_stages(barph_ctx_t * ctx, uint8_t * data, size_t len, uint8_t do_rle, uint8_t do_huff, uint8_t do_diff, uint32_t * checksum, size_t offset, byte_buffer_t * out, byte_buffer_t * result)
+{
+    double start = ctx->stats ? barph_now() : 0;
+    barph_delta_encode(data, len, do_diff, checksum, offset);
+    if (ctx->stats)
+        start = barph_stats_stage(ctx, BARPH_STAGE_DELTA, start, len, len);
+    if (barph_ctx_flags(ctx) && (do_rle || do_huff))
+        return barph_compress_planes(ctx, data, len, do_rle, do_huff, out, result);
+    return barph_compress_entropy(ctx, data, len, do_rle, do_huff, out, start, result);
+}
+
+// do_huff 4 needs a dictionary; without one, the code is stored like do_huff 2
+static uint8_t barph_huff_mode(const barph_dict_t * dict, uint8_t do_huff)
+{
+    return (do_huff == BARPH_HUFF_DICT && !dict) ? 2 : do_huff;
+}
+
+// adds the byte counts of what the Huffman stage would see, after delta coding and RLE with the given flags, for barph_dict_build
+// like barph_compress, the passed-in data is modified; returns nonzero if it runs out of memory
+BARPH_API int barph_dict_count(barph_ctx_t * ctx, uint64_t * counts, uint8_t * data, size_t len, uint8_t do_rle, uint8_t do_diff)
+{
+    // the stages are run directly, since barph_compress_stages would store data that RLE alone doesn't shrink
+    byte_buffer_t buf = {data, len, len, 0};
+    barph_delta_encode(data, len, do_diff, 0, 0);
+    if (do_rle)
+    {
+        ctx->scratch[0].len = 0;
+        if (barph_rle_compress(&ctx->scratch[0], &ctx->scratch[1], data, len, do_rle, ctx->lz_window) != 0)
+            return -1;
+        buf = ctx->scratch[0];
+    }
+    for (size_t i = 0; i < buf.len; i++)
+        counts[buf.data[i]] += 1;
+    return 0;
+}
+
+// automatic flag selection
+// evenly spread chunks of the input go through the delta and RLE stages for every candidate distance, and the Huffman stage's
+// output size is worked out from the byte counts of what comes out, without coding anything
+
+// how much of the input is sampled at most; otherwise it's a 128th of the input, but at least 1 KiB, in chunks of up to 4 KiB
+#ifndef BARPH_AUTO_SAMPLE
+#define BARPH_AUTO_SAMPLE (1 << 17)
+#endif
+#define BARPH_AUTO_CHUNK 4096
+
+// picks the flags that should compress data the smallest; data isn't modified
+// if it runs out of memory, it stops sampling and keeps what it's picked so far
+BARPH_API void barph_choose_flags(barph_ctx_t * ctx, const uint8_t * data, size_t len, uint8_t * do_rle, uint8_t * do_huff, uint8_t * do_diff)
+{
+    static const uint8_t dists[] = {0, 1, 2, 3, 4, 8};
+    
+    size_t sample_len = len / 128;
+    if (sample_len > BARPH_AUTO_SAMPLE)
+        sample_len = BARPH_AUTO_SAMPLE;
+    if (sample_len < 1024)
+        sample_len = 1024;
+    if (sample_len > len)
+        sample_len = len;
+    size_t chunk_len = sample_len < BARPH_AUTO_CHUNK ? sample_len : BARPH_AUTO_CHUNK;
+    size_t chunk_count = chunk_len ? (sample_len + chunk_len - 1) / chunk_len : 0;
+    size_t stride = chunk_count ? len / chunk_count : 0;
+    // whole chunks can add up to more than was asked for
+    sample_len = 0;
+    for (size_t c = 0; c < chunk_count; c++)
+        sample_len += len - c * stride < chunk_len ? len - c * stride : chunk_len;
+    
+    // the stored code is a fixed cost, so it only matters for small inputs; it's scaled down to the size of the sample
+    uint64_t code_bits = len ? (64 + 4 * 256) * (uint64_t)sample_len / len : 0;
+    
+    // no stages at all never makes anything bigger
+    uint64_t best = (uint64_t)sample_len * 8;
+    *do_rle = 0;
+    *do_huff = 0;
+    *do_diff = 0;
+    for (size_t d = 0; d < sizeof(dists); d++)
+    {
+        uint64_t counts[256] = {0};
+        uint64_t rle_counts[256] = {0};
+        uint64_t rle_bits = 0;
+        for (size_t c = 0; c < chunk_count; c++)
+        {
+            size_t start = c * stride;
+            size_t n = len - start < chunk_len ? len - start : chunk_len;
+            byte_buffer_t * chunk = &ctx->scratch[1];
+            chunk->len = 0;
+            if (bytes_push(chunk, &data[start], n) != 0)
+                return;
+            barph_delta_encode(chunk->data, n, dists[d], 0, 0);
+            for (size_t i = 0; i < n; i++)
+                counts[chunk->data[i]] += 1;
+            
+            // each chunk's RLE output starts with its 8 byte length, which the whole input only has once
+            ctx->scratch[0].len = 0;
+            if (super_big_rle_compress(&ctx->scratch[0], chunk->data, n) != 0)
+                return;
+            rle_bits += (ctx->scratch[0].len - 8) * 8;
+            for (size_t i = 8; i < ctx->scratch[0].len; i++)
+                rle_counts[ctx->scratch[0].data[i]] += 1;
+        }
+        
+        // in order of preference: fewer stages first, and later candidates have to be clearly better, so that sampling noise doesn't pick them
+        uint64_t sizes[4] = {(uint64_t)sample_len * 8, huff_estimate_bits(counts) + code_bits, rle_bits, huff_estimate_bits(rle_counts) + code_bits};
+        for (size_t k = 0; k < 4; k++)
+        {
+            if (sizes[k] < best - best / 64)
+            {
+                best = sizes[k];
+                *do_rle = k >= 2;
+                *do_huff = (k & 1) ? 2 : 0;
+                *do_diff = dists[d];
+            }
+        }
+    }
+}
+
+// the decompressed data is written once, into its destination: RLE expands straight into it, and single-stream Huffman data
+// is decoded a window at a time into the RLE expander, so that the RLE data is never whole in memory either
+// the window has to hold the longest token, an RLE literal of 2 + 16383 bytes or an LZ token of a little over that, and is otherwise small enough to stay in cache
+
+#ifndef BARPH_FUSED_WINDOW
+#define BARPH_FUSED_WINDOW (1 << 16)
+#endif
+
+#if BARPH_FUSED_WINDOW < (1 << 15)
+#error "BARPH_FUSED_WINDOW has to be at least 32 KiB"
+#endif
+
+// where decompressed data of the given size goes: dest if it isn't null, or else the context's second scratch buffer; null if it's more than dest_cap,
+// which bounds the output even without dest, or the memory can't be had
+static uint8_t * barph_stages_out(barph_ctx_t * ctx, uint8_t * dest, size_t dest_cap, uint64_t size)
+{
+    if (size > dest_cap)
+        return 0;
+    if (dest)
+        return dest;
+    ctx->scratch[1].len = 0;
+    if (bytes_reserve(&ctx->scratch[1], size) != 0)
+        return 0;
+    ctx->scratch[1].len = size;
+    return ctx->scratch[1].data;
+}
+
+// single-stream decoding runs as one of a set of pipelines, one for each entropy coder and expander (none, RLE or LZ77), each built by a macro
+// with its stages called directly so that they're inlined into one loop; one is picked from the header for each piece of data, instead of
+// checking the flags on every window. pipelines that don't use LZ77 also undo delta coding and continue the checksum a window at a time,
+// while the window's output is still in cache; LZ77 matches copy from earlier output, which has to stay delta coded until they're done
+
+typedef struct {
+    const huff_table_t * table;
+    // the tANS states, if it's tANS
+    uint32_t ans_states[BARPH_ANS_STATES];
+    barph_delta_fn delta;
+    uint8_t do_diff;
+    uint32_t * checksum;
+    size_t offset;
+    // set by pipelines that undid the delta coding, so that it isn't done again
+    int delta_done;
+} barph_pipeline_t;
+
+// decodes `symbols` bytes from the stream in r, leaving the output where barph_stages_out puts it and its length in *size; returns nonzero if the data is malformed
+typedef int (*barph_pipeline_fn)(barph_ctx_t * ctx, barph_pipeline_t * p, bit_reader_t * r, size_t symbols, uint8_t * dest, size_t dest_cap, uint8_t ** out, uint64_t * size);
+
+// the decoders, for the pipelines: each decodes at least len bytes into out, and returns how many; Huffman entries can decode one more, and write a byte past len either way
+static size_t barph_unpack_huff(barph_pipeline_t * p, bit_reader_t * r, uint8_t * out, size_t len)
+{
+    return huff_unpack_symbols(p->table, r, out, len);
+}
+static size_t barph_unpack_ans(barph_pipeline_t * p, bit_reader_t * r, uint8_t * out, size_t len)
+{
+    ans_unpack_symbols(&p->table->ans, p->ans_states, r, out, len);
+    return len;
+}
+
+// without an expander, the decoded bytes are the output, so they're decoded straight into it; the last byte is decoded on its own
+// (into a spare pair, for Huffman entries that write one byte past it), so that nothing is written past the end of dest
+#define BARPH_PIPELINE_DIRECT(NAME, UNPACK) \
+static int barph_pipeline_##NAME(barph_ctx_t * ctx, barph_pipeline_t * p, bit_reader_t * r, size_t symbols, uint8_t * dest, size_t dest_cap, uint8_t ** out, uint64_t * size) \
+{ \
+    *size = symbols; \
+    *out = barph_stages_out(ctx, dest, dest_cap, symbols); \
+    if (!*out) \
+        return -1; \
+    size_t pos = 0; \
+    while (pos < symbols) \
+    { \
+        size_t want = symbols - pos - 1 < BARPH_FUSED_WINDOW ? symbols - pos - 1 : BARPH_FUSED_WINDOW; \
+        size_t got = 1; \
+        if (want == 0) \
+        { \
+            uint8_t last[2]; \
+            UNPACK(p, r, last, 1); \
+            (*out)[pos] = last[0]; \
+        } \
+        else \
+            got = UNPACK(p, r, &(*out)[pos], want); \
+        p->delta(*out, pos, pos + got, p->do_diff, p->checksum, p->offset); \
+        pos += got; \
+    } \
+    p->delta_done = 1; \
+    return 0; \
+}
+
+// with an expander, the decoded bytes go into a window, and whole tokens are expanded from it into the output as soon as they're decoded
+#define BARPH_PIPELINE_EXPAND(NAME, UNPACK, EXPANDED_SIZE, EXPAND, DELTA) \
+static int barph_pipeline_##NAME(barph_ctx_t * ctx, barph_pipeline_t * p, bit_reader_t * r, size_t symbols, uint8_t * dest, size_t dest_cap, uint8_t ** out, uint64_t * size) \
+{ \
+    byte_buffer_t * window = &ctx->scratch[0]; \
+    window->len = 0; \
+    /* one byte of slack, for two-symbol entries that decode past the end */ \
+    if (bytes_reserve(window, BARPH_FUSED_WINDOW + 1) != 0) \
+        return -1; \
+    \
+    *out = 0; \
+    size_t pos = 0; \
+    size_t fill = 0; \
+    size_t left = symbols; \
+    while (left > 0) \
+    { \
+        size_t want = BARPH_FUSED_WINDOW - fill < left ? BARPH_FUSED_WINDOW - fill : left; \
+        /* an entry that runs over the end of the window decoded the next symbol early, but one that runs over the end of the stream decoded padding */ \
+        size_t got = UNPACK(p, r, &window->data[fill], want); \
+        if (got > left) \
+            got = left; \
+        fill += got; \
+        left -= got; \
+        \
+        /* the expanded length comes first, so it's in the first window */ \
+        size_t used = 0; \
+        if (!*out) \
+        { \
+            if (fill < 8 || EXPANDED_SIZE(window->data, symbols, size) != 0) \
+                return -1; \
+            *out = barph_stages_out(ctx, dest, dest_cap, *size); \
+            if (!*out) \
+                return -1; \
+            used = 8; \
+        } \
+        size_t done = pos; \
+        size_t taken; \
+        if (EXPAND(*out, *size, &pos, &window->data[used], fill - used, &taken) != 0) \
+            return -1; \
+        used += taken; \
+        if (DELTA) \
+            p->delta(*out, done, pos, p->do_diff, p->checksum, p->offset); \
+        \
+        /* a token cut off by the end of the window moves to its start */ \
+        memmove(window->data, &window->data[used], fill - used); \
+        fill -= used; \
+    } \
+    p->delta_done = DELTA; \
+    return (*out && fill == 0 && pos == *size) ? 0 : -1; \
+}
+
+BARPH_PIPELINE_DIRECT(huff, barph_unpack_huff)
+BARPH_PIPELINE_DIRECT(ans, barph_unpack_ans)
+BARPH_PIPELINE_EXPAND(huff_rle, barph_unpack_huff, rle_expanded_size, rle_expand, 1)
+BARPH_PIPELINE_EXPAND(ans_rle, barph_unpack_ans, rle_expanded_size, rle_expand, 1)
+BARPH_PIPELINE_EXPAND(huff_lz, barph_unpack_huff, lz_expanded_size, lz_expand, 0)
+BARPH_PIPELINE_EXPAND(ans_lz, barph_unpack_ans, lz_expanded_size, lz_expand, 0)
+
+// indexed by do_rle, then by whether it's tANS
+static const barph_pipeline_fn barph_pipelines[BARPH_RLE_MAX_MODE + 1][2] = {
+    {barph_pipeline_huff, barph_pipeline_ans},
+    {barph_pipeline_huff_rle, barph_pipeline_ans_rle},
+    {barph_pipeline_huff_lz, barph_pipeline_ans_lz},
+};
+
+// the pipeline for the given flags, which have to be for a single stream
+static barph_pipeline_fn barph_pipeline_pick(uint8_t do_rle, uint8_t do_huff)
+{
+    return barph_pipelines[do_rle == BARPH_RLE_LZ ? 2 : do_rle ? 1 : 0][do_huff == BARPH_HUFF_ANS];
+}
+
+// a pipeline that undoes delta coding with distance do_diff (0 for none) and continues checksum over the output, if it isn't null
+static void barph_pipeline_init(barph_pipeline_t * p, uint8_t do_diff, uint32_t * checksum, size_t offset)
+{
+    p->table = 0;
+    p->delta = barph_delta_decoder(do_diff);
+    p->do_diff = do_diff;
+    p->checksum = checksum;
+    p->offset = offset;
+    p->delta_done = 0;
+}
+
+// undoes barph_compress_entropy, writing into dest if it isn't null, or else into one of the context's scratch buffers, and failing if it needs more than
+// dest_cap bytes either way; *start is when the stage before started, for stats, and is moved past the stages that run. returns nonzero if the data is malformed
+// single streams go through one of the pipelines, which sets p->delta_done if it undid p's delta coding too
+// stats time each stage, so with them, the stages run one after the other instead of being fused
+static int barph_decompress_entropy(barph_ctx_t * ctx, barph_pipeline_t * p, const uint8_t * data, size_t len, uint8_t do_rle, uint8_t do_huff, uint8_t * dest, size_t dest_cap, byte_buffer_t * result, double * start)
+{
+    byte_buffer_t buf = {(uint8_t *)data, len, len, 0};
+    // the encoder's RLE and LZ77 tokens never take more than 3 bytes per output byte, plus the length
+    uint64_t max_symbols = !do_rle ? dest_cap : dest_cap < (SIZE_MAX - 8) / 3 ? (uint64_t)dest_cap * 3 + 8 : SIZE_MAX;
+    
+    if (do_huff && do_huff != 3 && !ctx->stats)
+    {
+        p->table = do_huff == BARPH_HUFF_DICT ? (ctx->dict ? &ctx->dict->table : 0) : &ctx->table;
+        bit_reader_t r = {data, len, 0, 0, 0};
+        size_t symbols;
+        int failed = do_huff == BARPH_HUFF_DICT ? huff_unpack_dict_header(ctx->dict, data, len, &r, &symbols, max_symbols) : huff_unpack_header(&ctx->table, &r, &symbols, do_huff, max_symbols);
+        if (!failed && do_huff == BARPH_HUFF_ANS)
+            ans_load_states(&ctx->table.ans, &r, p->ans_states);
+        uint8_t * out;
+        uint64_t size;
+        if (failed || barph_pipeline_pick(do_rle, do_huff)(ctx, p, &r, symbols, dest, dest_cap, &out, &size) != 0)
+            return -1;
+        buf.data = out;
+        buf.len = size;
+    }
+    else
+    {
+        if (do_huff)
+        {
+            int failed = do_huff == BARPH_HUFF_DICT ? huff_unpack_dict(&ctx->scratch[0], ctx->dict, data, len, max_symbols) : huff_unpack(&ctx->scratch[0], &ctx->table, data, len, do_huff, max_symbols);
+            if (failed)
+                return -1;
+            buf = ctx->scratch[0];
+            if (ctx->stats)
+            {
+                barph_stats_huff(ctx->stats, data, len, buf.len, do_huff, ctx->dict);
+                *start = barph_stats_stage(ctx, BARPH_STAGE_HUFF, *start, len, buf.len);
+            }
+        }
+        if (do_rle)
+        {
+            uint64_t size;
+            uint8_t * out;
+            if (barph_rle_expanded_size(do_rle, buf.data, buf.len, &size) != 0 || !(out = barph_stages_out(ctx, dest, dest_cap, size)))
+                return -1;
+            if (barph_rle_expand_all(do_rle, out, size, buf.data, buf.len) != 0)
+                return -1;
+            if (ctx->stats)
+            {
+                if (do_rle != BARPH_RLE_LZ)
+                    barph_stats_rle(ctx->stats, buf.data, buf.len);
+                *start = barph_stats_stage(ctx, BARPH_STAGE_RLE, *start, buf.len, size);
+            }
+            buf.data = out;
+            buf.len = size;
+        }
+        // without RLE, the data still has to be copied to where it goes, since delta decoding happens in place
+        else if (buf.data == data || dest)
+        {
+            uint8_t * out = barph_stages_out(ctx, dest, dest_cap, buf.len);
+            if (!out)
+                return -1;
+            memcpy(out, buf.data, buf.len);
+            buf.data = out;
+        }
+    }
+    buf.cap = buf.len;
+    *result = buf;
+    return 0;
+}
+
+// undoes barph_compress_planes, like barph_decompress_entropy
+static int barph_decompress_planes(barph_ctx_t * ctx, const uint8_t * data, size_t len, uint8_t do_rle, uint8_t do_huff, uint8_t * dest, size_t dest_cap, byte_buffer_t * result, double * start)
+{
+    size_t pos = 1;
+    uint64_t raw_len;
+    uint64_t packed_lens[BARPH_MAX_PLANES];
+    if (len < 1 || data[0] < 2 || data[0] > BARPH_MAX_PLANES || load_varint(data, len, &pos, &raw_len) != 0)
+        return -1;
+    size_t k = data[0];
+    uint64_t total = 0;
+    for (size_t j = 0; j + 1 < k; j++)
+    {
+        if (load_varint(data, len, &pos, &packed_lens[j]) != 0 || packed_lens[j] > len)
+            return -1;
+        total += packed_lens[j];
+    }
+    // the last plane is whatever's left
+    if (total > len - pos)
+        return -1;
+    packed_lens[k - 1] = len - pos - total;
+    // no plane expands more than 2048 times over, 8 from Huffman coding times 256 from LZ77
+    if (raw_len / 2048 > len || raw_len > dest_cap)
+        return -1;
+    
+    // the planes are delta coded together, so that's left until they're joined
+    barph_pipeline_t p;
+    barph_pipeline_init(&p, 0, 0, 0);
+    byte_buffer_t * planes = &ctx->scratch[2];
+    planes->len = 0;
+    if (bytes_reserve(planes, raw_len) != 0)
+        return -1;
+    size_t plane_start = 0;
+    for (size_t j = 0; j < k; j++)
+    {
+        size_t n = barph_plane_len(raw_len, k, j);
+        byte_buffer_t plane;
+        if (packed_lens[j] == n)
+            memcpy(&planes->data[plane_start], &data[pos], n);
+        else if (barph_decompress_entropy(ctx, &p, &data[pos], packed_lens[j], do_rle, do_huff, &planes->data[plane_start], n, &plane, start) != 0 || plane.len != n)
+            return -1;
+        pos += packed_lens[j];
+        plane_start += n;
+    }
+    
+    uint8_t * out = barph_stages_out(ctx, dest, dest_cap, raw_len);
+    if (!out)
+        return -1;
+    barph_planes_join(out, planes->data, raw_len, k);
+    byte_buffer_t joined = {out, raw_len, raw_len, 0};
+    *result = joined;
+    return 0;
+}
+
+// undoes barph_compress_stages; planes says whether the file has BARPH_FLAG_PLANES. returns nonzero if the data is malformed
+// the result is written into dest if it isn't null, or else into one of the context's scratch buffers, and fails if it needs more than dest_cap bytes either way
+static int barph_decompress_stages(barph_ctx_t * ctx, const uint8_t * data, size_t len, uint8_t do_rle, uint8_t do_huff, uint8_t do_diff, int planes, uint32_t * checksum, size_t offset, uint8_t * dest, size_t dest_cap, byte_buffer_t * result)
+{
+    byte_buffer_t buf;
+    barph_pipeline_t p;
+    barph_pipeline_init(&p, do_diff, checksum, offset);
+    double start = ctx->stats ? barph_now() : 0;
+    int failed = (planes && (do_rle || do_huff)) ? barph_decompress_planes(ctx, data, len, do_rle, do_huff, dest, dest_cap, &buf, &start)
+        : barph_decompress_entropy(ctx, &p, data, len, do_rle, do_huff, dest, dest_cap, &buf, &start);
+    if (failed)
+        return -1;
+    if (!p.delta_done)
+        p.delta(buf.data, 0, buf.len, do_diff, checksum, offset);
+    if (ctx->stats)
+        barph_stats_stage(ctx, BARPH_STAGE_DELTA, start, buf.len, buf.len);
+    *result = buf;
+    return 0;
+}
+
+// the compressed size of len bytes is never more than this, whatever the flags, for barph_compress and barph_compress_into
+// (RLE adds at most 2 bytes per 16 literal bytes plus its 8 byte length, and LZ77 less than that, and a stored Huffman code is never worse than 8 bits per byte, plus its header,
+// but a dictionary's code can spend up to BARPH_HUFF_MAX_BITS bits on bytes that its samples didn't have, and tANS needs two bytes per byte while it works)
+BARPH_API size_t barph_compress_bound(size_t len)
+{
+    return (len + len / 8 + 16) * 2 + 1024;
+}
+
+// like barph_compress, but keeps its working memory in ctx, and codes with its dictionary, LZ77 window, planes and threads;
+// with none of those but threads, the output is the same as barph_compress's, so older versions can read it
+// returns null if it runs out of memory
+BARPH_API uint8_t * barph_compress_ctx(barph_ctx_t * ctx, uint8_t * data, size_t len, uint8_t do_rle, uint8_t do_huff, uint8_t do_diff, size_t * out_len)
+{
+    if (!data || !out_len) return 0;
+    
+    do_huff = barph_huff_mode(ctx->dict, do_huff);
+    uint32_t checksum = BARPH_CHECKSUM_INIT;
+    
+    // the last stage writes straight after the header, whose checksum is filled in once it's known
+    byte_buffer_t real_buf = {0, 0, 0, 0};
+    byte_buffer_t buf;
+    if (barph_push_header(&real_buf, barph_ctx_flags(ctx), do_rle, do_huff, do_diff, 0) != 0
+        || barph_compress_stages(ctx, data, len, do_rle, do_huff, do_diff, &checksum, 0, &real_buf, &buf) != 0)
+    {
+        BARPH_FREE(real_buf.data);
+        return 0;
+    }
+    store_u32le(&real_buf.data[8], checksum);
+    // whole files that were stored say so by not having RLE or Huffman coding
+    if (buf.len == len)
+        memset(&real_buf.data[6], 0, 2);
+    
+    if (ctx->stats)
+    {
+        ctx->stats->allocs += 1;
+        if (ctx->scratch[0].cap + ctx->scratch[1].cap + real_buf.cap > ctx->stats->peak_bytes)
+            ctx->stats->peak_bytes = ctx->scratch[0].cap + ctx->scratch[1].cap + real_buf.cap;
+    }
+    
+    *out_len = real_buf.len;
+    return real_buf.data;
+}
+
+// like barph_compress, but adds to stats if it isn't null
+BARPH_API uint8_t * barph_compress_stats(uint8_t * data, size_t len, uint8_t do_rle, uint8_t do_huff, uint8_t do_diff, size_t * out_len, barph_stats_t * stats)
+{
+    double start = stats ? barph_now() : 0;
+    barph_ctx_t ctx;
+    barph_ctx_init(&ctx);
+    ctx.stats = stats;
+    uint8_t * out = barph_compress_ctx(&ctx, data, len, do_rle, do_huff, do_diff, out_len);
+    barph_ctx_free(&ctx);
+    if (stats)
+        stats->seconds += barph_now() - start;
+    return out;
+}
+
 // passed-in data is modified, but not stored; it still belongs to the caller, and must be freed by the caller
-// returned data must be freed by the caller; it was allocated with BARPH_MALLOC
-static uint8_t * barph_decompress(uint8_t * data, size_t len, size_t * out_len)
+// returned data must be freed by the caller; it was allocated with BARPH_MALLOC. returns null if it runs out of memory
+BARPH_API uint8_t * barph_compress(uint8_t * data, size_t len, uint8_t do_rle, uint8_t do_huff, uint8_t do_diff, size_t * out_len)
+{
+    return barph_compress_stats(data, len, do_rle, do_huff, do_diff, out_len, 0);
+}
+
+// like barph_compress, but writes into out, and keeps its working memory in ctx; returns nonzero if out_cap is too small,
+// which it never is if it's at least barph_compress_bound(len), or len + 20 (since data that doesn't shrink is stored), or if it runs out of memory
+// the output also stores the decompressed length, for barph_decompressed_size
+// do_huff 4 codes with ctx->dict, and ctx->planes splits the data into byte planes
+BARPH_API int barph_compress_into(barph_ctx_t * ctx, uint8_t * data, size_t len, uint8_t do_rle, uint8_t do_huff, uint8_t do_diff, uint8_t * out, size_t out_cap, size_t * out_len)
+{
+    do_huff = barph_huff_mode(ctx->dict, do_huff);
+    uint32_t checksum = BARPH_CHECKSUM_INIT;
+    
+    // with room for the worst case, the last stage writes straight into out; if it ever needed more than out_cap anyway,
+    // it would have moved into memory of its own rather than reallocating out, and that's an error
+    if (out_cap >= barph_compress_bound(len))
+    {
+        byte_buffer_t real_buf = {out, 0, out_cap, 1};
+        barph_push_header(&real_buf, BARPH_FLAG_SIZE | barph_ctx_flags(ctx), do_rle, do_huff, do_diff, 0);
+        bytes_push_u64(&real_buf, len);
+        byte_buffer_t buf;
+        int failed = barph_compress_stages(ctx, data, len, do_rle, do_huff, do_diff, &checksum, 0, &real_buf, &buf);
+        if (failed || real_buf.data != out)
+        {
+            if (real_buf.data != out)
+                BARPH_FREE(real_buf.data);
+            return -1;
+        }
+        store_u32le(&out[8], checksum);
+        if (buf.len == len)
+            memset(&out[6], 0, 2);
+        *out_len = real_buf.len;
+        return 0;
+    }
+    
+    byte_buffer_t buf;
+    if (barph_compress_stages(ctx, data, len, do_rle, do_huff, do_diff, &checksum, 0, 0, &buf) != 0 || out_cap < BARPH_HEADER_SIZE + 8 + buf.len)
+        return -1;
+    if (buf.len == len)
+    {
+        do_rle = 0;
+        do_huff = 0;
+    }
+    
+    // has enough room already, so it never reallocates
+    byte_buffer_t real_buf = {out, 0, out_cap, 1};
+    barph_push_header(&real_buf, BARPH_FLAG_SIZE | barph_ctx_flags(ctx), do_rle, do_huff, do_diff, checksum);
+    bytes_push_u64(&real_buf, len);
+    bytes_push(&real_buf, buf.data, buf.len);
+    
+    *out_len = real_buf.len;
+    return 0;
+}
+
+// checks the header of a whole file, returning nonzero if it isn't valid
+static int barph_check_header(const uint8_t * data, size_t len)
+{
+    if (len < BARPH_HEADER_SIZE || memcmp(data, "bRPH", 4) != 0 || (data[4] & ~BARPH_KNOWN_FLAGS) || data[6] > BARPH_RLE_MAX_MODE || data[7] > BARPH_HUFF_MAX_MODE)
+        return -1;
+    if ((data[4] & BARPH_FLAG_SIZE) && (data[4] & (BARPH_FLAG_BLOCKS | BARPH_FLAG_STREAM)))
+        return -1;
+    if ((data[4] & BARPH_FLAG_SIZE) && len < BARPH_HEADER_SIZE + 8)
+        return -1;
+    return 0;
+}
+
+// the length that data decompresses to, if it's stored: files from barph_compress_into and barph_compress_blocks store it,
+// but files from barph_compress and streams don't; returns nonzero if it isn't stored
+BARPH_API int barph_decompressed_size(const uint8_t * data, size_t len, uint64_t * size)
+{
+    if (barph_check_header(data, len) != 0)
+        return -1;
+    if (data[4] & BARPH_FLAG_SIZE)
+    {
+        *size = load_u64le(&data[BARPH_HEADER_SIZE]);
+        return 0;
+    }
+    if ((data[4] & BARPH_FLAG_BLOCKS) && len >= BARPH_HEADER_SIZE + 12)
+    {
+        *size = load_u64le(&data[BARPH_HEADER_SIZE + 4]);
+        return 0;
+    }
+    return -1;
+}
+
+// the ID of the dictionary that data was compressed with, for picking which one to decompress it with; returns nonzero if it doesn't use one
+BARPH_API int barph_dict_id(const uint8_t * data, size_t len, uint32_t * id)
+{
+    if (barph_check_header(data, len) != 0 || data[7] != BARPH_HUFF_DICT || (data[4] & BARPH_FLAG_BLOCKS))
+        return -1;
+    size_t start = BARPH_HEADER_SIZE;
+    if (data[4] & BARPH_FLAG_SIZE)
+        start += 8;
+    // streams are checked at their first frame, which has to have data in it
+    if (data[4] & BARPH_FLAG_STREAM)
+    {
+        if (len < start + 8 || load_u32le(&data[start]) == 0)
+            return -1;
+        start += 8;
+    }
+    if (len < start + 4)
+        return -1;
+    *id = load_u32le(&data[start]);
+    return 0;
+}
+
+// decompresses a whole file that isn't a block container or stream into dest, or one of the context's scratch buffers if it's null, and checks it;
+// returns nonzero if it's malformed or doesn't fit in dest_cap
+static int barph_decompress_single(barph_ctx_t * ctx, const uint8_t * data, size_t len, uint8_t * dest, size_t dest_cap, byte_buffer_t * result)
+{
+    uint8_t flags = data[4];
+    uint8_t do_diff = data[5];
+    uint8_t do_rle = data[6];
+    uint8_t do_huff = data[7];
+    uint32_t stored_checksum = load_u32le(&data[8]);
+    size_t start = (flags & BARPH_FLAG_SIZE) ? BARPH_HEADER_SIZE + 8 : BARPH_HEADER_SIZE;
+    // a stored length bounds what the stages may produce, before anything's allocated for it
+    if ((flags & BARPH_FLAG_SIZE) && load_u64le(&data[BARPH_HEADER_SIZE]) < dest_cap)
+        dest_cap = (size_t)load_u64le(&data[BARPH_HEADER_SIZE]);
+    
+    // files with a checksum of 0 aren't checked
+    uint32_t checksum = stored_checksum;
+    int hashed = flags & BARPH_FLAG_HASH;
+    // the serial checksum is taken in the same pass that undoes the delta filter
+    if (stored_checksum != 0 && !hashed)
+        checksum = BARPH_CHECKSUM_INIT;
+    if (barph_decompress_stages(ctx, &data[start], len - start, do_rle, do_huff, do_diff, flags & BARPH_FLAG_PLANES, (stored_checksum != 0 && !hashed) ? &checksum : 0, 0, dest, dest_cap, result) != 0)
+        return -1;
+    if (stored_checksum != 0 && hashed)
+    {
+        double start = ctx->stats ? barph_now() : 0;
+        checksum = barph_hash_final(barph_hash_fold(BARPH_CHECKSUM_INIT, barph_hash(result->data, result->len)));
+        if (ctx->stats)
+            barph_stats_stage(ctx, BARPH_STAGE_HASH, start, result->len, 0);
+    }
+    
+    if ((flags & BARPH_FLAG_SIZE) && load_u64le(&data[BARPH_HEADER_SIZE]) != result->len)
+        return -1;
+    return checksum == stored_checksum ? 0 : -1;
+}
+
+// like barph_decompress, but writes into out, and keeps its working memory in ctx; returns nonzero if the data is malformed or doesn't fit in out_cap,
+// in which case out may have been written to
+// block containers and streams aren't supported, since they're meant for data too big to want a single buffer for
+BARPH_API int barph_decompress_into(barph_ctx_t * ctx, const uint8_t * data, size_t len, uint8_t * out, size_t out_cap, size_t * out_len)
+{
+    if (barph_check_header(data, len) != 0 || (data[4] & (BARPH_FLAG_BLOCKS | BARPH_FLAG_STREAM)))
+        return -1;
+    byte_buffer_t buf;
+    if (barph_decompress_single(ctx, data, len, out, out_cap, &buf) != 0)
+        return -1;
+    *out_len = buf.len;
+    return 0;
+}
+
+typedef struct {
+    uint8_t * data;
+    size_t len;
+    size_t block_size;
+    uint8_t do_rle;
+    uint8_t do_huff;
+    uint8_t do_diff;
+    // a block whose data is null ran out of memory
+    byte_buffer_t * blocks;
+    uint64_t * hashes;
+} barph_block_job_t;
+
+static void barph_compress_block_task(void * userdata, size_t index)
+{
+    barph_block_job_t * job = (barph_block_job_t *)userdata;
+    size_t start = index * job->block_size;
+    size_t len = job->len - start < job->block_size ? job->len - start : job->block_size;
+    job->hashes[index] = barph_hash(&job->data[start], len);
+    barph_ctx_t ctx;
+    barph_ctx_init(&ctx);
+    byte_buffer_t block;
+    if (barph_compress_stages(&ctx, &job->data[start], len, job->do_rle, job->do_huff, job->do_diff, 0, 0, 0, &block) != 0)
+        memset(&job->blocks[index], 0, sizeof(byte_buffer_t));
+    else
+        job->blocks[index] = barph_ctx_take(&ctx, block);
+    barph_ctx_free(&ctx);
+}
+
+// like barph_compress, but splits the data into independent blocks of block_size bytes (0 for the default), compressed across thread_count threads (0 for one per core)
+// the output doesn't depend on the number of threads; returns null if it runs out of memory
+BARPH_API uint8_t * barph_compress_blocks(uint8_t * data, size_t len, uint8_t do_rle, uint8_t do_huff, uint8_t do_diff, size_t block_size, size_t thread_count, size_t * out_len)
 {
     if (!data || !out_len) return 0;
+    if (block_size == 0)
+        block_size = BARPH_BLOCK_SIZE;
+    if (block_size > 0xFFFFFFFF)
+        return 0;
+    do_huff = barph_huff_mode(0, do_huff);
+    
+    size_t block_count = (len + block_size - 1) / block_size;
+    barph_block_job_t job = {data, len, block_size, do_rle, do_huff, do_diff, 0, 0};
+    job.blocks = (byte_buffer_t *)BARPH_MALLOC(sizeof(byte_buffer_t) * (block_count ? block_count : 1));
+    job.hashes = (uint64_t *)BARPH_MALLOC(sizeof(uint64_t) * (block_count ? block_count : 1));
+    if (!job.blocks || !job.hashes)
+    {
+        BARPH_FREE(job.blocks);
+        BARPH_FREE(job.hashes);
+        return 0;
+    }
+    barph_parallel_for(block_count, thread_count, barph_compress_block_task, &job);
     
-    byte_buffer_t buf = {data, len, len};
+    uint64_t hash = BARPH_CHECKSUM_INIT;
+    for (size_t i = 0; i < block_count; i++)
+        hash = barph_hash_fold(hash, job.hashes[i]);
+    BARPH_FREE(job.hashes);
     
-    if (buf.len < 8 || memcmp(buf.data, "bRPH", 5) != 0)
+    size_t total = BARPH_HEADER_SIZE + 4 + 8 + block_count * 8;
+    int failed = 0;
+    for (size_t i = 0; i < block_count; i++)
     {
-        puts("invalid barph file");
-        exit(0);
+        total += job.blocks[i].len;
+        failed |= !job.blocks[i].data;
     }
-    uint8_t do_diff = buf.data[5];
-    uint8_t do_rle = buf.data[6];
-    uint8_t do_huff = buf.data[7];
     
-    uint32_t stored_checksum = buf.data[8]
-        | (((uint32_t)buf.data[9]) << 8)
-        | (((uint32_t)buf.data[10]) << 16)
-        | (((uint32_t)buf.data[11]) << 24);
+    // with all of the room made up front, none of the pushes below can fail
+    byte_buffer_t real_buf = {0, 0, 0, 0};
+    if (failed || bytes_reserve(&real_buf, total) != 0)
+    {
+        for (size_t i = 0; i < block_count; i++)
+            BARPH_FREE(job.blocks[i].data);
+        BARPH_FREE(job.blocks);
+        return 0;
+    }
     
-    buf.data += 12;
-    buf.len -= 12;
+    barph_push_header(&real_buf, BARPH_FLAG_BLOCKS | BARPH_FLAG_HASH | BARPH_FLAG_STORED, do_rle, do_huff, do_diff, barph_hash_final(hash));
+    bytes_push_u32(&real_buf, block_size);
+    bytes_push_u64(&real_buf, len);
+    size_t offset = 0;
+    for (size_t i = 0; i < block_count; i++)
+    {
+        bytes_push_u64(&real_buf, offset);
+        offset += job.blocks[i].len;
+    }
+    for (size_t i = 0; i < block_count; i++)
+    {
+        bytes_push(&real_buf, job.blocks[i].data, job.blocks[i].len);
+        BARPH_FREE(job.blocks[i].data);
+    }
+    BARPH_FREE(job.blocks);
     
-    if (do_huff)
+    *out_len = real_buf.len;
+    return real_buf.data;
+}
+
+typedef struct {
+    const uint8_t * data;
+    size_t len;
+    const uint8_t * offsets;
+    size_t block_size;
+    uint8_t do_rle;
+    uint8_t do_huff;
+    uint8_t do_diff;
+    // whether blocks as long as their raw length are stored
+    uint8_t stored;
+    uint8_t planes;
+    uint8_t * out;
+    size_t out_len;
+    // null unless the blocks are to be hashed
+    uint64_t * hashes;
+    // set for each block that fails; one byte per block, so threads never write to the same one
+    uint8_t * failed;
+} barph_unblock_job_t;
+
+static void barph_decompress_block_task(void * userdata, size_t index)
+{
+    barph_unblock_job_t * job = (barph_unblock_job_t *)userdata;
+    size_t block_count = (job->out_len + job->block_size - 1) / job->block_size;
+    uint64_t start = load_u64le(&job->offsets[index * 8]);
+    uint64_t end = index + 1 < block_count ? load_u64le(&job->offsets[index * 8 + 8]) : job->len;
+    job->failed[index] = 0;
+    if (start > end || end > job->len)
     {
-        bit_buffer_t compressed;
-        memset(&compressed, 0, sizeof(bit_buffer_t));
-        compressed.buffer = buf;
-        byte_buffer_t new_buf = huff_unpack(&compressed);
-        if (buf.data != data + 12)
-            BARPH_FREE(buf.data);
-        buf = new_buf;
+        job->failed[index] = 1;
+        return;
     }
-    if (do_rle)
+    
+    size_t out_start = index * job->block_size;
+    size_t out_len = job->out_len - out_start < job->block_size ? job->out_len - out_start : job->block_size;
+    barph_ctx_t ctx;
+    barph_ctx_init(&ctx);
+    byte_buffer_t block;
+    int stored = job->stored && end - start == out_len;
+    if (barph_decompress_stages(&ctx, &job->data[start], end - start, stored ? 0 : job->do_rle, stored ? 0 : job->do_huff, job->do_diff, job->planes, 0, 0, &job->out[out_start], out_len, &block) != 0 || block.len != out_len)
+        job->failed[index] = 1;
+    else if (job->hashes)
+        job->hashes[index] = barph_hash(block.data, block.len);
+    barph_ctx_free(&ctx);
+}
+
+// streaming
+// input is compressed one block at a time as it comes in, and output is handed to a callback as soon as it's ready,
+// so memory use depends on the block size but not on the length of the input
+
+typedef void (*barph_write_fn)(void * userdata, const uint8_t * data, size_t len);
+
+typedef struct {
+    barph_write_fn write;
+    void * userdata;
+    uint8_t do_rle;
+    uint8_t do_huff;
+    uint8_t do_diff;
+    size_t block_size;
+    byte_buffer_t pending;
+    // block hash state
+    uint64_t hash;
+    barph_ctx_t ctx;
+    uint8_t started;
+    // set once it runs out of memory, after which nothing more is written
+    uint8_t failed;
+} barph_encoder_t;
+
+// block_size 0 means the default; dict is the dictionary for do_huff 4, or null, and must outlive the encoder
+// the header is written along with the first frame, so settings in ctx that it depends on, like planes, can still be changed after this
+BARPH_API void barph_encoder_init(barph_encoder_t * e, uint8_t do_rle, uint8_t do_huff, uint8_t do_diff, size_t block_size, const barph_dict_t * dict, barph_write_fn write, void * userdata)
+{
+    memset(e, 0, sizeof(barph_encoder_t));
+    do_huff = barph_huff_mode(dict, do_huff);
+    e->write = write;
+    e->userdata = userdata;
+    e->do_rle = do_rle;
+    e->do_huff = do_huff;
+    e->do_diff = do_diff;
+    e->block_size = (block_size && block_size <= 0xFFFFFFFF) ? block_size : BARPH_BLOCK_SIZE;
+    e->hash = BARPH_CHECKSUM_INIT;
+    barph_ctx_init(&e->ctx);
+    e->ctx.dict = dict;
+}
+
+static void barph_encoder_start(barph_encoder_t * e)
+{
+    if (e->started)
+        return;
+    uint8_t header[BARPH_HEADER_SIZE];
+    byte_buffer_t buf = {header, 0, BARPH_HEADER_SIZE, 1};
+    barph_push_header(&buf, BARPH_FLAG_STREAM | BARPH_FLAG_HASH | BARPH_FLAG_STORED | barph_ctx_flags(&e->ctx), e->do_rle, e->do_huff, e->do_diff, 0);
+    e->write(e->userdata, header, BARPH_HEADER_SIZE);
+    e->started = 1;
+}
+
+// compresses and writes out everything that's been fed so far, even if it's less than a whole block
+static void barph_encoder_flush(barph_encoder_t * e)
+{
+    if (e->pending.len == 0 || e->failed)
+        return;
+    barph_encoder_start(e);
+    
+    double start = e->ctx.stats ? barph_now() : 0;
+    e->hash = barph_hash_fold(e->hash, barph_hash(e->pending.data, e->pending.len));
+    if (e->ctx.stats)
+        barph_stats_stage(&e->ctx, BARPH_STAGE_HASH, start, e->pending.len, 0);
+    byte_buffer_t block;
+    if (barph_compress_stages(&e->ctx, e->pending.data, e->pending.len, e->do_rle, e->do_huff, e->do_diff, 0, 0, 0, &block) != 0)
+    {
+        e->failed = 1;
+        return;
+    }
+    uint8_t frame[8];
+    store_u64le(frame, e->pending.len | (((uint64_t)block.len) << 32));
+    e->write(e->userdata, frame, 8);
+    e->write(e->userdata, block.data, block.len);
+    
+    e->pending.len = 0;
+}
+
+// returns nonzero if the encoder has run out of memory, now or before
+BARPH_API int barph_encoder_feed(barph_encoder_t * e, const uint8_t * data, size_t len)
+{
+    while (len > 0 && !e->failed)
     {
-        byte_buffer_t new_buf = super_big_rle_decompress(buf.data, buf.len);
-        if (buf.data != data + 12)
-            BARPH_FREE(buf.data);
-        buf = new_buf;
+        size_t n = e->block_size - e->pending.len;
+        if (n > len)
+            n = len;
+        if (bytes_push(&e->pending, data, n) != 0)
+            e->failed = 1;
+        data += n;
+        len -= n;
+        if (e->pending.len == e->block_size)
+            barph_encoder_flush(e);
     }
-    if (do_diff)
+    return e->failed ? -1 : 0;
+}
+
+// writes out the rest of the stream, and frees everything the encoder holds; returns nonzero if it ran out of memory,
+// and then the stream is left without its end, so that it doesn't decompress
+BARPH_API int barph_encoder_finish(barph_encoder_t * e)
+{
+    barph_encoder_flush(e);
+    if (!e->failed)
     {
-        for (size_t i = do_diff; i < buf.len; i += 1)
-            buf.data[i] += buf.data[i - do_diff];
+        barph_encoder_start(e);
+        
+        uint32_t checksum = barph_hash_final(e->hash);
+        uint8_t trailer[12] = {0};
+        trailer[8] = checksum;
+        trailer[9] = checksum >> 8;
+        trailer[10] = checksum >> 16;
+        trailer[11] = checksum >> 24;
+        e->write(e->userdata, trailer, 12);
     }
     
-    const uint32_t big_prime = 0x1011B0D5;
-    uint32_t checksum = 0x87654321;
+    BARPH_FREE(e->pending.data);
+    e->pending.data = 0;
+    barph_ctx_free(&e->ctx);
+    return e->failed ? -1 : 0;
+}
+
+typedef struct {
+    barph_write_fn write;
+    void * userdata;
+    uint8_t do_rle;
+    uint8_t do_huff;
+    uint8_t do_diff;
+    uint8_t flags;
+    // 0: header, 1: frames, 2: checksum, 3: done, 4: failed
+    uint8_t state;
+    byte_buffer_t pending;
+    // serial checksum or block hash state, depending on the flags
+    uint32_t checksum;
+    uint64_t hash;
+    uint64_t total;
+    barph_ctx_t ctx;
+} barph_decoder_t;
+
+// dict is the dictionary for streams made with do_huff 4, or null, and must outlive the decoder
+BARPH_API void barph_decoder_init(barph_decoder_t * d, const barph_dict_t * dict, barph_write_fn write, void * userdata)
+{
+    memset(d, 0, sizeof(barph_decoder_t));
+    d->write = write;
+    d->userdata = userdata;
+    d->checksum = BARPH_CHECKSUM_INIT;
+    d->hash = BARPH_CHECKSUM_INIT;
+    barph_ctx_init(&d->ctx);
+    d->ctx.dict = dict;
+}
+
+// how many bytes the next piece of the stream takes up, given the start of it, or 0 if that isn't known yet
+static size_t barph_decoder_need(const barph_decoder_t * d, const uint8_t * data, size_t len)
+{
+    if (d->state == 0)
+        return BARPH_HEADER_SIZE;
+    if (d->state == 2)
+        return 4;
+    return len >= 8 ? 8 + (size_t)load_u32le(&data[4]) : 0;
+}
+
+// handles one whole piece of the stream; returns nonzero if it's malformed
+static int barph_decoder_handle(barph_decoder_t * d, const uint8_t * unit)
+{
+    if (d->state == 0)
+    {
+        if (memcmp(unit, "bRPH", 4) != 0 || (unit[4] & ~(BARPH_FLAG_HASH | BARPH_FLAG_STORED | BARPH_FLAG_PLANES)) != BARPH_FLAG_STREAM || unit[6] > BARPH_RLE_MAX_MODE || unit[7] > BARPH_HUFF_MAX_MODE)
+            return -1;
+        d->flags = unit[4];
+        d->do_diff = unit[5];
+        d->do_rle = unit[6];
+        d->do_huff = unit[7];
+        d->state = 1;
+    }
+    else if (d->state == 1)
+    {
+        size_t raw_len = load_u32le(unit);
+        size_t packed_len = load_u32le(&unit[4]);
+        if (raw_len == 0)
+        {
+            d->state = 2;
+            return 0;
+        }
+        int hashed = d->flags & BARPH_FLAG_HASH;
+        int stored = (d->flags & BARPH_FLAG_STORED) && packed_len == raw_len;
+        byte_buffer_t block;
+        if (barph_decompress_stages(&d->ctx, &unit[8], packed_len, stored ? 0 : d->do_rle, stored ? 0 : d->do_huff, d->do_diff, d->flags & BARPH_FLAG_PLANES, hashed ? 0 : &d->checksum, d->total, 0, raw_len, &block) != 0 || block.len != raw_len)
+            return -1;
+        if (hashed)
+        {
+            double start = d->ctx.stats ? barph_now() : 0;
+            d->hash = barph_hash_fold(d->hash, barph_hash(block.data, block.len));
+            if (d->ctx.stats)
+                barph_stats_stage(&d->ctx, BARPH_STAGE_HASH, start, block.len, 0);
+        }
+        d->total += block.len;
+        d->write(d->userdata, block.data, block.len);
+        return 0;
+    }
+    else if (d->state == 2)
+    {
+        uint32_t checksum = (d->flags & BARPH_FLAG_HASH) ? barph_hash_final(d->hash) : d->checksum;
+        if (load_u32le(unit) != checksum)
+            return -1;
+        d->state = 3;
+    }
+    return 0;
+}
+
+// returns nonzero if the stream is malformed, including if it continues past its end
+BARPH_API int barph_decoder_feed(barph_decoder_t * d, const uint8_t * data, size_t len)
+{
+    while (len > 0 && d->state < 3)
+    {
+        // whole pieces can be handled straight from the caller's buffer, without copying them
+        size_t need = barph_decoder_need(d, data, len);
+        if (d->pending.len == 0 && need && need <= len)
+        {
+            if (barph_decoder_handle(d, data) != 0)
+                d->state = 4;
+            data += need;
+            len -= need;
+            continue;
+        }
+        
+        need = barph_decoder_need(d, d->pending.data, d->pending.len);
+        // frame lengths aren't known until the first 8 bytes of the frame are in
+        if (!need)
+            need = 8;
+        size_t n = need - d->pending.len;
+        if (n > len)
+            n = len;
+        if (bytes_push(&d->pending, data, n) != 0)
+        {
+            d->state = 4;
+            break;
+        }
+        data += n;
+        len -= n;
+        if (d->pending.len == barph_decoder_need(d, d->pending.data, d->pending.len))
+        {
+            if (barph_decoder_handle(d, d->pending.data) != 0)
+                d->state = 4;
+            d->pending.len = 0;
+        }
+    }
+    if (len > 0)
+        d->state = 4;
+    return d->state == 4 ? -1 : 0;
+}
+
+// frees everything the decoder holds; returns nonzero unless the stream ended properly and its checksum matched
+BARPH_API int barph_decoder_finish(barph_decoder_t * d)
+{
+    BARPH_FREE(d->pending.data);
+    d->pending.data = 0;
+    barph_ctx_free(&d->ctx);
+    return d->state == 3 ? 0 : -1;
+}
+
+// for barph_write_to_buffer: what's been written so far, and whether it ran out of memory for some of it
+typedef struct {
+    byte_buffer_t buffer;
+    int failed;
+} barph_buffer_sink_t;
+
+static void barph_write_to_buffer(void * userdata, const uint8_t * data, size_t len)
+{
+    barph_buffer_sink_t * sink = (barph_buffer_sink_t *)userdata;
+    if (bytes_push(&sink->buffer, data, len) != 0)
+        sink->failed = 1;
+}
+
+// decompresses a block container into out, which needs room for all of it (barph_decompressed_size gives how much), across thread_count threads
+// (0 for one per core); returns nonzero if data isn't a valid block container, or fails its checksum
+BARPH_API int barph_decompress_blocks_into(const uint8_t * data, size_t len, size_t thread_count, uint8_t * out, size_t out_cap, size_t * out_len)
+{
+    if (barph_check_header(data, len) != 0 || !(data[4] & BARPH_FLAG_BLOCKS) || len < BARPH_HEADER_SIZE + 12)
+        return -1;
+    uint8_t flags = data[4];
+    uint8_t do_diff = data[5];
+    uint8_t do_rle = data[6];
+    uint8_t do_huff = data[7];
+    // files with a checksum of 0 aren't checked
+    uint32_t stored_checksum = load_u32le(&data[8]);
+    data += BARPH_HEADER_SIZE;
+    len -= BARPH_HEADER_SIZE;
+    
+    size_t block_size = load_u32le(data);
+    uint64_t total = load_u64le(&data[4]);
+    size_t block_count = block_size ? (total + block_size - 1) / block_size : 0;
+    if (block_size == 0 || block_count > (len - 12) / 8 || total > out_cap)
+        return -1;
+    
+    size_t table_len = 12 + block_count * 8;
+    barph_unblock_job_t job = {&data[table_len], len - table_len, &data[12], block_size, do_rle, do_huff, do_diff, (flags & BARPH_FLAG_STORED) != 0, (flags & BARPH_FLAG_PLANES) != 0, out, total, 0, 0};
+    job.failed = (uint8_t *)BARPH_MALLOC(block_count ? block_count : 1);
+    if (!job.failed)
+        return -1;
+    // without room for the hashes, the checksum is taken over all of out afterwards instead
+    if ((flags & BARPH_FLAG_HASH) && stored_checksum != 0)
+        job.hashes = (uint64_t *)BARPH_MALLOC(sizeof(uint64_t) * (block_count ? block_count : 1));
+    barph_parallel_for(block_count, thread_count, barph_decompress_block_task, &job);
+    int failed = 0;
+    for (size_t i = 0; i < block_count; i++)
+        failed |= job.failed[i];
+    BARPH_FREE(job.failed);
+    if (failed)
+    {
+        BARPH_FREE(job.hashes);
+        return -1;
+    }
+    
+    uint32_t checksum = stored_checksum;
+    if (job.hashes)
+    {
+        uint64_t hash = BARPH_CHECKSUM_INIT;
+        for (size_t i = 0; i < block_count; i++)
+            hash = barph_hash_fold(hash, job.hashes[i]);
+        checksum = barph_hash_final(hash);
+        BARPH_FREE(job.hashes);
+    }
+    else if (stored_checksum != 0)
+        checksum = barph_checksum(out, total);
+    if (checksum != stored_checksum)
+        return -1;
+    *out_len = total;
+    return 0;
+}
+
+// like barph_decompress_threaded, but adds to stats if it isn't null; the blocks of block containers only add to the total time
+BARPH_API uint8_t * barph_decompress_stats(uint8_t * data, size_t len, size_t thread_count, size_t * out_len, barph_stats_t * stats)
+{
+    if (!data || !out_len) return 0;
+    double start = stats ? barph_now() : 0;
+    
+    if (barph_check_header(data, len) != 0)
+        return 0;
+    uint8_t flags = data[4];
+    
+    if (flags & BARPH_FLAG_STREAM)
+    {
+        barph_buffer_sink_t out = {{0, 0, 0, 0}, 0};
+        barph_decoder_t d;
+        barph_decoder_init(&d, 0, barph_write_to_buffer, &out);
+        d.ctx.stats = stats;
+        int failed = barph_decoder_feed(&d, data, len);
+        // the output buffer has to be a real allocation, even when empty
+        if (barph_decoder_finish(&d) != 0 || failed || out.failed || bytes_reserve(&out.buffer, 0) != 0)
+        {
+            BARPH_FREE(out.buffer.data);
+            return 0;
+        }
+        if (stats)
+            stats->seconds += barph_now() - start;
+        *out_len = out.buffer.len;
+        return out.buffer.data;
+    }
+    if (flags & BARPH_FLAG_BLOCKS)
+    {
+        uint64_t total;
+        if (barph_decompressed_size(data, len, &total) != 0 || total > SIZE_MAX)
+            return 0;
+        uint8_t * out = (uint8_t *)BARPH_MALLOC(total ? total : 1);
+        if (!out || barph_decompress_blocks_into(data, len, thread_count, out, total, out_len) != 0)
+        {
+            BARPH_FREE(out);
+            return 0;
+        }
+        if (stats)
+            stats->seconds += barph_now() - start;
+        return out;
+    }
+    
+    barph_ctx_t ctx;
+    barph_ctx_init(&ctx);
+    ctx.stats = stats;
+    byte_buffer_t result;
+    int failed = barph_decompress_single(&ctx, data, len, 0, SIZE_MAX, &result);
+    if (!failed)
+        result = barph_ctx_take(&ctx, result);
+    barph_ctx_free(&ctx);
+    if (failed)
+        return 0;
+    if (stats)
+        stats->seconds += barph_now() - start;
+    *out_len = result.len;
+    return result.data;
+}
+
+// like barph_decompress, but decompresses the blocks of block containers across thread_count threads (0 for one per core)
+BARPH_API uint8_t * barph_decompress_threaded(uint8_t * data, size_t len, size_t thread_count, size_t * out_len)
+{
+    return barph_decompress_stats(data, len, thread_count, out_len, 0);
+}
+
+// passed-in data is not modified or stored; it still belongs to the caller, and must be freed by the caller
+// returned data must be freed by the caller; it was allocated with BARPH_MALLOC
+// returns null if the data isn't a valid barph file, is malformed, or fails its checksum
+BARPH_API uint8_t * barph_decompress(uint8_t * data, size_t len, size_t * out_len)
+{
+    return barph_decompress_threaded(data, len, 1, out_len);
+}
+
+// random access
+// block containers and streams are made of independent pieces, each with its length up front, so a range of the decompressed data
+// only needs the pieces that cover it to be decompressed; other files are decompressed whole
+// the hash of a block container or stream covers all of its pieces, so their ranges aren't checked beyond each piece decoding properly
+
+// decompresses one piece of a block container or stream, whose raw_len bytes start piece_start bytes into the whole, and copies the part of it
+// that's inside the range into out; pieces wholly inside the range are decompressed straight into out. returns nonzero if the piece is malformed
+static int barph_range_piece(barph_ctx_t * ctx, const uint8_t * data, size_t len, uint8_t do_rle, uint8_t do_huff, uint8_t do_diff, int planes, uint64_t piece_start, size_t raw_len, uint64_t offset, size_t range_len, uint8_t * out)
+{
+    uint64_t from = piece_start > offset ? piece_start : offset;
+    uint64_t to = piece_start + raw_len < offset + range_len ? piece_start + raw_len : offset + range_len;
+    if (from >= to)
+        return 0;
+    byte_buffer_t piece;
+    if (from == piece_start && to == piece_start + raw_len)
+        return (barph_decompress_stages(ctx, data, len, do_rle, do_huff, do_diff, planes, 0, 0, &out[from - offset], raw_len, &piece) != 0 || piece.len != raw_len) ? -1 : 0;
+    if (barph_decompress_stages(ctx, data, len, do_rle, do_huff, do_diff, planes, 0, 0, 0, raw_len, &piece) != 0 || piece.len != raw_len)
+        return -1;
+    memcpy(&out[from - offset], &piece.data[from - piece_start], to - from);
+    return 0;
+}
+
+// decompresses the range_len bytes that start offset bytes into what data decompresses to (or fewer, if it ends first) into out, which must have room
+// for range_len bytes, keeping working memory in ctx; do_huff 4 uses ctx->dict. returns nonzero if the data is malformed, or offset is past its end
+BARPH_API int barph_decompress_range(barph_ctx_t * ctx, const uint8_t * data, size_t len, uint64_t offset, size_t range_len, uint8_t * out, size_t * out_len)
+{
+    if (barph_check_header(data, len) != 0)
+        return -1;
+    uint8_t flags = data[4];
+    uint8_t do_diff = data[5];
+    uint8_t do_rle = data[6];
+    uint8_t do_huff = data[7];
+    // so that offset + range_len can't overflow
+    if (range_len > UINT64_MAX - offset)
+        range_len = UINT64_MAX - offset;
+    
+    if (flags & BARPH_FLAG_BLOCKS)
+    {
+        if (len < BARPH_HEADER_SIZE + 12)
+            return -1;
+        size_t block_size = load_u32le(&data[BARPH_HEADER_SIZE]);
+        uint64_t total = load_u64le(&data[BARPH_HEADER_SIZE + 4]);
+        size_t block_count = block_size ? (total + block_size - 1) / block_size : 0;
+        if (block_size == 0 || block_count > (len - BARPH_HEADER_SIZE - 12) / 8 || offset > total)
+            return -1;
+        if (range_len > total - offset)
+            range_len = total - offset;
+        
+        const uint8_t * offsets = &data[BARPH_HEADER_SIZE + 12];
+        size_t payload_at = BARPH_HEADER_SIZE + 12 + block_count * 8;
+        for (size_t i = offset / block_size; i < block_count && (uint64_t)i * block_size < offset + range_len; i++)
+        {
+            uint64_t start = load_u64le(&offsets[i * 8]);
+            uint64_t end = i + 1 < block_count ? load_u64le(&offsets[i * 8 + 8]) : len - payload_at;
+            if (start > end || end > len - payload_at)
+                return -1;
+            uint64_t piece_start = (uint64_t)i * block_size;
+            size_t raw_len = total - piece_start < block_size ? total - piece_start : block_size;
+            int stored = (flags & BARPH_FLAG_STORED) && end - start == raw_len;
+            if (barph_range_piece(ctx, &data[payload_at + start], end - start, stored ? 0 : do_rle, stored ? 0 : do_huff, do_diff, flags & BARPH_FLAG_PLANES, piece_start, raw_len, offset, range_len, out) != 0)
+                return -1;
+        }
+        *out_len = range_len;
+        return 0;
+    }
+    if (flags & BARPH_FLAG_STREAM)
+    {
+        // frames are walked by their lengths, and only the ones in the range are decompressed
+        size_t pos = BARPH_HEADER_SIZE;
+        uint64_t at = 0;
+        // until the frames cover the range, and offset is known to be inside the stream
+        while (at < offset + range_len || at <= offset)
+        {
+            if (len - pos < 8)
+                return -1;
+            size_t raw_len = load_u32le(&data[pos]);
+            size_t packed_len = load_u32le(&data[pos + 4]);
+            pos += 8;
+            if (raw_len == 0)
+                break;
+            if (packed_len > len - pos)
+                return -1;
+            int stored = (flags & BARPH_FLAG_STORED) && packed_len == raw_len;
+            if (barph_range_piece(ctx, &data[pos], packed_len, stored ? 0 : do_rle, stored ? 0 : do_huff, do_diff, flags & BARPH_FLAG_PLANES, at, raw_len, offset, range_len, out) != 0)
+                return -1;
+            at += raw_len;
+            pos += packed_len;
+        }
+        if (offset > at)
+            return -1;
+        *out_len = at - offset < range_len ? at - offset : range_len;
+        return 0;
+    }
+    
+    byte_buffer_t result;
+    if (barph_decompress_single(ctx, data, len, 0, SIZE_MAX, &result) != 0 || offset > result.len)
+        return -1;
+    if (range_len > result.len - offset)
+        range_len = result.len - offset;
+    memcpy(out, &result.data[offset], range_len);
+    *out_len = range_len;
+    return 0;
+}
+
+// whole files
+// files are mapped into memory where the platform allows, so input is read straight out of the page cache instead of being copied into a buffer,
+// and output whose size is stored up front is decompressed straight into the output file's pages
+// files that can't be mapped (empty ones, pipes, or everything with BARPH_NO_MMAP) are read and written with stdio instead
+
+typedef struct {
+    uint8_t * data;
+    size_t len;
+    // set if data is mapped, rather than allocated with BARPH_MALLOC
+    int mapped;
+    // set for output that isn't mapped, which is written out when it's closed
+    FILE * out;
+} barph_file_t;
+
+#if !defined(BARPH_NO_MMAP)
+// maps the file at path for reading, copy-on-write; returns nonzero if it can't be mapped
+static int barph_file_map(barph_file_t * file, const char * path)
+{
+#if defined(_WIN32)
+    HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+    LARGE_INTEGER size;
+    if (handle != INVALID_HANDLE_VALUE && GetFileSizeEx(handle, &size) && size.QuadPart > 0 && (uint64_t)size.QuadPart <= SIZE_MAX)
+    {
+        // the view keeps the mapping and the file open by itself
+        HANDLE mapping = CreateFileMappingA(handle, 0, PAGE_WRITECOPY, 0, 0, 0);
+        if (mapping)
+        {
+            file->data = (uint8_t *)MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, (size_t)size.QuadPart);
+            CloseHandle(mapping);
+        }
+        file->len = (size_t)size.QuadPart;
+    }
+    if (handle != INVALID_HANDLE_VALUE)
+        CloseHandle(handle);
+#else
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd >= 0 && fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0 && (uint64_t)info.st_size <= SIZE_MAX)
+    {
+        void * data = mmap(0, (size_t)info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+            file->data = (uint8_t *)data;
+        file->len = (size_t)info.st_size;
+    }
+    if (fd >= 0)
+        close(fd);
+#endif
+    file->mapped = file->data != 0;
+    return file->mapped ? 0 : -1;
+}
+#endif
+
+// maps the file at path for reading; pages are copied when they're written to, so data can be modified (as the compressor does) without changing the file
+// copy reads it into a buffer instead, for data that's about to be written to whole (by delta coding), since copying it a page at a time is slower
+// returns nonzero if it can't be read in whole
+static int barph_file_read(barph_file_t * file, const char * path, int copy)
+{
+    memset(file, 0, sizeof(barph_file_t));
+#if !defined(BARPH_NO_MMAP)
+    if (!copy && barph_file_map(file, path) == 0)
+        return 0;
+#else
+    (void)copy;
+#endif
+    
+    FILE * f = fopen(path, "rb");
+    if (!f)
+        return -1;
+    // files are read in one go; pipes can't be measured ahead of time, so they're read until they end
+    byte_buffer_t buf = {0, 0, 0, 0};
+    long known = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+    int failed = bytes_reserve(&buf, known > 0 ? (size_t)known + 1 : 1 << 16);
+    rewind(f);
+    while (!failed)
+    {
+        if (buf.len == buf.cap && bytes_reserve(&buf, 1 << 16) != 0)
+        {
+            failed = 1;
+            break;
+        }
+        size_t n = fread(&buf.data[buf.len], 1, buf.cap - buf.len, f);
+        if (n == 0)
+            break;
+        buf.len += n;
+    }
+    failed |= ferror(f);
+    fclose(f);
+    if (failed)
+    {
+        BARPH_FREE(buf.data);
+        return -1;
+    }
+    file->data = buf.data;
+    file->len = buf.len;
+    return 0;
+}
+
+// creates the file at path, len bytes long, and maps it for writing; returns nonzero if it can't be created
+static int barph_file_create(barph_file_t * file, const char * path, size_t len)
+{
+    memset(file, 0, sizeof(barph_file_t));
+    file->len = len;
+#if !defined(BARPH_NO_MMAP)
+#if defined(_WIN32)
+    HANDLE handle = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+    if (handle == INVALID_HANDLE_VALUE)
+        return -1;
+    // mapping more than the file holds grows it, or fails if there isn't room
+    HANDLE mapping = len ? CreateFileMappingA(handle, 0, PAGE_READWRITE, (DWORD)((uint64_t)len >> 32), (DWORD)len, 0) : 0;
+    if (mapping)
+    {
+        file->data = (uint8_t *)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, len);
+        CloseHandle(mapping);
+    }
+    CloseHandle(handle);
+#else
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        return -1;
+    // running out of room while writing to a mapping can't be caught, so the room is taken up front where that's possible
+    // (posix_fallocate needs POSIX.1-2001 or later)
+#if defined(__linux__) && defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200112L
+    int sized = len && posix_fallocate(fd, 0, len) == 0;
+#else
+    int sized = len && ftruncate(fd, len) == 0;
+#endif
+    if (sized)
+    {
+        void * data = mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data != MAP_FAILED)
+            file->data = (uint8_t *)data;
+    }
+    close(fd);
+#endif
+    if (file->data)
+    {
+        file->mapped = 1;
+        return 0;
+    }
+#endif
     
-    if (stored_checksum != 0)
+    file->out = fopen(path, "wb");
+    file->data = (uint8_t *)BARPH_MALLOC(len ? len : 1);
+    if (!file->out || !file->data)
+    {
+        if (file->out)
+            fclose(file->out);
+        BARPH_FREE(file->data);
+        file->data = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// unmaps or frees a file, writing it out first if it's output that isn't mapped; returns nonzero if it couldn't be written
+static int barph_file_close(barph_file_t * file)
+{
+    int failed = 0;
+    if (file->mapped)
+    {
+#if !defined(BARPH_NO_MMAP)
+#if defined(_WIN32)
+        failed = !UnmapViewOfFile(file->data);
+#else
+        failed = munmap(file->data, file->len) != 0;
+#endif
+#endif
+    }
+    else
+    {
+        if (file->out)
+        {
+            failed = fwrite(file->data, 1, file->len, file->out) != file->len;
+            failed = fclose(file->out) != 0 || failed;
+        }
+        BARPH_FREE(file->data);
+    }
+    file->data = 0;
+    file->out = 0;
+    return failed;
+}
+
+static void barph_write_to_stdio(void * userdata, const uint8_t * data, size_t len)
+{
+    fwrite(data, 1, len, (FILE *)userdata);
+}
+
+// writes len bytes into a new file at path, or to out if path is null; returns nonzero if they couldn't all be written, and path is removed if it was made
+static int barph_write_file(const char * path, FILE * out, const uint8_t * data, size_t len)
+{
+    FILE * f = path ? fopen(path, "wb") : out;
+    int failed = !f || fwrite(data, 1, len, f) != len;
+    if (!path)
+        return (f && fflush(f) != 0) || failed;
+    if (f && (fclose(f) != 0 || failed))
+    {
+        remove(path);
+        failed = 1;
+    }
+    return failed;
+}
+
+// compresses the file at in_path into a new file at out_path; returns nonzero if either file can't be read or written, or the output can't be had,
+// and out_path is removed if it was made
+// sized stores the decompressed length, like barph_compress_into, so that barph_decompress_file can decompress straight into the mapped output file;
+// otherwise the output is the same as barph_compress_ctx's. the input is mapped rather than read, unless it's delta coded
+BARPH_API int barph_compress_file(barph_ctx_t * ctx, const char * in_path, const char * out_path, uint8_t do_rle, uint8_t do_huff, uint8_t do_diff, int sized)
+{
+    barph_file_t in;
+    if (barph_file_read(&in, in_path, do_diff != 0) != 0)
+        return -1;
+    size_t out_len = 0;
+    uint8_t * out;
+    int failed;
+    if (sized)
     {
-        for (size_t i = 0; i < buf.len; i += 1)
-            checksum = (checksum ^ buf.data[i] ^ i) * big_prime;
+        size_t cap = barph_compress_bound(in.len);
+        out = (uint8_t *)BARPH_MALLOC(cap);
+        failed = !out || barph_compress_into(ctx, in.data, in.len, do_rle, do_huff, do_diff, out, cap, &out_len) != 0;
     }
     else
-        checksum = stored_checksum;
+    {
+        out = barph_compress_ctx(ctx, in.data, in.len, do_rle, do_huff, do_diff, &out_len);
+        failed = !out;
+    }
+    barph_file_close(&in);
     
-    if (checksum == stored_checksum)
+    if (!failed)
+        failed = barph_write_file(out_path, 0, out, out_len);
+    BARPH_FREE(out);
+    return failed ? -1 : 0;
+}
+
+// decompresses data into a new file at out_path, or to out if out_path is null, with ctx->dict for files that need it, and the blocks of block containers
+// across ctx->threads threads; returns nonzero if data isn't a valid barph file or fails its checksum, or if the output can't be written, and out_path is removed if it was made
+// files that store their decompressed length (from barph_compress_into and barph_compress_blocks) are decompressed straight into the mapped output file,
+// and streams are written as they're decoded; out can't be mapped, so output for it that isn't a stream goes through memory
+BARPH_API int barph_decompress_to_file(barph_ctx_t * ctx, const uint8_t * data, size_t len, const char * out_path, FILE * out)
+{
+    if (barph_check_header(data, len) != 0)
+        return -1;
+    
+    int failed;
+    uint64_t size;
+    if (data[4] & BARPH_FLAG_STREAM)
     {
-        *out_len = buf.len;
-        return buf.data;
+        FILE * f = out_path ? fopen(out_path, "wb") : out;
+        if (!f)
+            return -1;
+        barph_decoder_t d;
+        barph_decoder_init(&d, ctx->dict, barph_write_to_stdio, f);
+        d.ctx.stats = ctx->stats;
+        failed = barph_decoder_feed(&d, data, len);
+        failed = barph_decoder_finish(&d) != 0 || failed || ferror(f);
+        failed = (out_path ? fclose(f) : fflush(f)) != 0 || failed;
+    }
+    else if (barph_decompressed_size(data, len, &size) == 0 && size <= SIZE_MAX)
+    {
+        barph_file_t dest;
+        if (out_path)
+        {
+            if (barph_file_create(&dest, out_path, (size_t)size) != 0)
+                return -1;
+        }
+        else
+        {
+            memset(&dest, 0, sizeof(barph_file_t));
+            dest.len = (size_t)size;
+            dest.data = (uint8_t *)BARPH_MALLOC(dest.len ? dest.len : 1);
+            if (!dest.data)
+                return -1;
+        }
+        size_t dest_len = 0;
+        if (data[4] & BARPH_FLAG_BLOCKS)
+            failed = barph_decompress_blocks_into(data, len, ctx->threads, dest.data, dest.len, &dest_len);
+        else
+            failed = barph_decompress_into(ctx, data, len, dest.data, dest.len, &dest_len);
+        failed = failed || dest_len != size;
+        if (!out_path && !failed)
+            failed = barph_write_file(0, out, dest.data, dest.len);
+        failed = barph_file_close(&dest) != 0 || failed;
     }
     else
     {
-        if (buf.data != data)
-            BARPH_FREE(buf.data);
-        return 0;
+        // files from barph_compress don't store their length, so they're decompressed into ctx first
+        byte_buffer_t result;
+        if (barph_decompress_single(ctx, data, len, 0, SIZE_MAX, &result) != 0)
+            return -1;
+        return barph_write_file(out_path, out, result.data, result.len) ? -1 : 0;
     }
+    if (failed && out_path)
+        remove(out_path);
+    return failed ? -1 : 0;
+}
+
+// like barph_decompress_to_file, but reads the file at in_path, which is mapped rather than read where that's possible
+BARPH_API int barph_decompress_file(barph_ctx_t * ctx, const char * in_path, const char * out_path, FILE * out)
+{
+    barph_file_t in;
+    if (barph_file_read(&in, in_path, 0) != 0)
+        return -1;
+    int failed = barph_decompress_to_file(ctx, in.data, in.len, out_path, out);
+    barph_file_close(&in);
+    return failed;
 }
 
 #endif // BARPH_IMPL_HEADER